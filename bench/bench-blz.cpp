@@ -0,0 +1,328 @@
+// Benchmark for BLZ::compress and BLZ::uncompress.
+//
+// usage: bench-blz [--level <level>] [--jobs <N>] [--min-time <seconds>] [<files...>]
+//
+// Runs every compression level (or only the given one) with N threads per input
+// (1 by default) over a synthetic corpus
+// and the given files. For each input, it reports the compressed ratio, the
+// speed of compression and decompression in MB/s of uncompressed data and the
+// peak heap memory used while compressing. It also checks that the output
+// decompresses to the input, and exits with 1 if that isn't the case.
+
+#include "blz.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Heap usage tracking. Every allocation is prefixed with its size.
+// Not inlined, or GCC mistakes the size prefix for an out-of-bounds access.
+
+static std::atomic<std::size_t> currentHeapSize = 0;
+static std::atomic<std::size_t> peakHeapSize = 0;
+
+constexpr std::size_t allocHeaderSize = alignof(std::max_align_t);
+
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+	void* p = std::malloc(size + allocHeaderSize);
+
+	if (!p)
+		throw std::bad_alloc();
+
+	*static_cast<std::size_t*>(p) = size;
+
+	const std::size_t newHeapSize = currentHeapSize += size;
+	std::size_t peak = peakHeapSize;
+
+	while (newHeapSize > peak && !peakHeapSize.compare_exchange_weak(peak, newHeapSize));
+
+	return static_cast<char*>(p) + allocHeaderSize;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+	if (!p)
+		return;
+
+	void* block = static_cast<char*>(p) - allocHeaderSize;
+	currentHeapSize -= *static_cast<std::size_t*>(block);
+	std::free(block);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	operator delete(p);
+}
+
+struct Input
+{
+	std::string name;
+	std::vector<u8> data;
+};
+
+// Synthetic inputs, all generated from a fixed seed
+
+static std::vector<u8> makeCodeLike(std::size_t size)
+{
+	std::mt19937 rng(1);
+	std::vector<u32> commonWords(256);
+
+	// ARM-like instructions: a few opcodes with varying register fields
+	for (u32& word : commonWords)
+		word = 0xe0000000 | (rng() & 0x0ff00000) | (rng() & 0xff) << (rng() % 3 * 4);
+
+	std::vector<u8> data;
+	data.reserve(size);
+
+	while (data.size() < size)
+	{
+		u32 word;
+
+		switch (rng() % 8)
+		{
+		case 0: word = rng(); break;                                    // literal pool
+		case 1: word = 0xeb000000 | (rng() & 0xffffff); break;          // bl
+		case 2: word = 0x02000000 | (rng() & 0x3ffffc); break;          // pointer
+		default: word = commonWords[rng() % commonWords.size()]; break;
+		}
+
+		for (int i = 0; i < 4; i++)
+			data.push_back(word >> (i * 8));
+	}
+
+	data.resize(size);
+	return data;
+}
+
+static std::vector<u8> makeTextLike(std::size_t size)
+{
+	static constexpr std::string_view words[] =
+	{
+		"the", "star", "power", "castle", "door", "key", "of", "and", "to", "a",
+		"Mario", "Luigi", "Wario", "Yoshi", "Bowser", "Peach", "coin", "red", "blue",
+		"you", "can", "find", "jump", "high", "here", "is", "in", "this", "course"
+	};
+
+	std::mt19937 rng(2);
+	std::vector<u8> data;
+	data.reserve(size + 16);
+
+	while (data.size() < size)
+	{
+		const std::string_view word = words[rng() % std::size(words)];
+		data.insert(data.end(), word.begin(), word.end());
+
+		switch (rng() % 12)
+		{
+		case 0: data.push_back('.'); data.push_back('\n'); break;
+		case 1: data.push_back(','); data.push_back(' '); break;
+		default: data.push_back(' '); break;
+		}
+	}
+
+	data.resize(size);
+	return data;
+}
+
+static std::vector<u8> makeIncompressible(std::size_t size)
+{
+	std::mt19937 rng(3);
+	std::vector<u8> data(size);
+
+	for (u8& byte : data)
+		byte = rng();
+
+	return data;
+}
+
+static std::vector<u8> makeRepetitive(std::size_t size)
+{
+	std::mt19937 rng(4);
+	std::vector<u8> data(size);
+
+	for (std::size_t i = 0; i < size; i++)
+		data[i] = i % 64 < 48 ? 0 : i / 64 % 16;
+
+	// a few mutations so that matches don't all have the same offset
+	for (std::size_t i = 0; i < size / 512; i++)
+		data[rng() % size] = rng();
+
+	return data;
+}
+
+static std::vector<u8> readFile(const fs::path& path)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::in);
+
+	if (!file.is_open())
+		throw std::runtime_error("failed to open file " + path.string());
+
+	std::vector<u8> data(fs::file_size(path));
+
+	if (!file.read(reinterpret_cast<char*>(data.data()), data.size()))
+		throw std::runtime_error("failed to read file " + path.string());
+
+	return data;
+}
+
+/**
+ * @brief Run a function at least 3 times and for at least minTime seconds.
+ *
+ * @return The shortest time of a single run in seconds.
+ */
+template<class Func>
+static double measure(double minTime, Func&& func)
+{
+	using Clock = std::chrono::steady_clock;
+
+	double best = 1e30;
+	double total = 0;
+
+	for (int runs = 0; runs < 3 || total < minTime; runs++)
+	{
+		const auto start = Clock::now();
+		func();
+		const double time = std::chrono::duration<double>(Clock::now() - start).count();
+
+		best = std::min(best, time);
+		total += time;
+	}
+
+	return best;
+}
+
+static double megabytesPerSecond(std::size_t size, double time)
+{
+	return size / time / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<BLZ::Level> levels = {BLZ::Level::fast, BLZ::Level::normal, BLZ::Level::max, BLZ::Level::scan};
+	unsigned jobs = 1;
+	double minTime = 0.5;
+	std::vector<Input> inputs;
+
+	try
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string_view arg = argv[i];
+
+			if ((arg == "--level" || arg == "--jobs" || arg == "--min-time") && i + 1 == argc)
+				throw std::invalid_argument("missing value for " + std::string(arg));
+
+			if (arg == "--level")
+			{
+				BLZ::Level level;
+
+				if (!BLZ::parseLevel(argv[++i], level))
+					throw std::invalid_argument("invalid compression level: " + std::string(argv[i]));
+
+				levels = {level};
+			}
+			else if (arg == "--jobs")
+				jobs = std::max(std::stoi(argv[++i]), 1);
+			else if (arg == "--min-time")
+				minTime = std::stod(argv[++i]);
+			else
+				inputs.push_back({fs::path(arg).filename().string(), readFile(arg)});
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "error: " << ex.what() << '\n';
+		return 2;
+	}
+
+	constexpr std::size_t syntheticSize = 256 * 1024;
+
+	inputs.insert(inputs.begin(),
+	{
+		{"code-like",      makeCodeLike(syntheticSize)},
+		{"text-like",      makeTextLike(syntheticSize)},
+		{"incompressible", makeIncompressible(syntheticSize)},
+		{"repetitive",     makeRepetitive(syntheticSize)},
+	});
+
+	std::cout << std::left << std::setw(20) << "input" << std::right
+		<< std::setw(10) << "size"
+		<< std::setw(8)  << "level"
+		<< std::setw(9)  << "ratio"
+		<< std::setw(12) << "comp MB/s"
+		<< std::setw(12) << "dec MB/s"
+		<< std::setw(12) << "peak KiB"
+		<< "  round trip\n";
+
+	bool failed = false;
+
+	for (const Input& input : inputs)
+	{
+		for (const BLZ::Level level : levels)
+		{
+			std::cout << std::left << std::setw(20) << input.name << std::right
+				<< std::setw(10) << input.data.size()
+				<< std::setw(8)  << BLZ::levelName(level)
+				<< std::fixed << std::setprecision(3);
+
+			std::vector<u8> compressed;
+
+			const std::size_t heapSizeBefore = currentHeapSize;
+			peakHeapSize = heapSizeBefore;
+
+			try
+			{
+				compressed = BLZ::compress(input.data, 0xff, level, jobs);
+			}
+			catch (const std::exception& ex)
+			{
+				std::cout << "  (" << ex.what() << ")\n";
+				continue;
+			}
+
+			const std::size_t peakHeapUsage = peakHeapSize - heapSizeBefore;
+
+			// The timed runs reuse their buffers, like a batch of files would
+			BLZ::Scratch scratch;
+			std::vector<u8> output(BLZ::compressBound(input.data.size()));
+
+			const double compressTime = measure(minTime, [&]
+			{
+				BLZ::compress(input.data, output, scratch, 0xff, level, jobs);
+			});
+
+			std::vector<u8> uncompressed(input.data.size());
+
+			const double uncompressTime = measure(minTime, [&]
+			{
+				BLZ::uncompress(compressed, uncompressed);
+			});
+
+			const bool roundTripOK = uncompressed == input.data;
+			failed = failed || !roundTripOK;
+
+			std::cout
+				<< std::setw(9)  << std::setprecision(3) << double(compressed.size()) / input.data.size()
+				<< std::setw(12) << std::setprecision(2) << megabytesPerSecond(input.data.size(), compressTime)
+				<< std::setw(12) << std::setprecision(2) << megabytesPerSecond(input.data.size(), uncompressTime)
+				<< std::setw(12) << (peakHeapUsage + 1023) / 1024
+				<< "  " << (roundTripOK ? "ok" : "FAILED") << '\n';
+		}
+	}
+
+	return failed ? 1 : 0;
+}
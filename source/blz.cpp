@@ -1,20 +1,78 @@
 #include "blz.hpp"
 #include "common.h"
+#include "parallel.h"
 
 #include <stdexcept>
+#include <algorithm>
 #include <cstring>
+#include <bit>
+#include <optional>
+#include <span>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 static const char* SRC_SHORTAGE = "Source shortage.";
 static const char* DEST_OVERRUN = "Destination overrun.";
 
+#ifdef __SSE2__
+/**
+ * @brief Compare 16 bytes.
+ * 
+ * @return A mask with bit i set if a[i] == b[i].
+ */
+static u32 equalMask16(const u8* a, const u8* b)
+{
+	const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+	const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+}
+
+/**
+ * @brief Compare 16 bytes with a single value.
+ * 
+ * @return A mask with bit i set if p[i] == value.
+ */
+static u32 findMask16(const u8* p, u8 value)
+{
+	const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(value)));
+}
+
+/**
+ * @brief Compare 32 bytes with a single value.
+ * 
+ * @return A mask with bit i set if p[i] == value.
+ */
+__attribute__((target("avx2")))
+static u32 findMask32(const u8* p, u8 value)
+{
+	const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(value)));
+}
+
+static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+#endif
+
 static int CompressBackward_sub2(const u8 *a1, const u8 *a2, int a3)
 {
-	int i;
-	for (i = 0; i < a3 && *a1 == *a2; ++i)
+	int i = 0;
+#ifdef __SSE2__
+	// Compare 16 bytes at a time, the first mismatch is the highest clear bit
+	for (; i + 16 <= a3; i += 16)
 	{
-		--a1;
-		--a2;
+		const u32 mismatch = ~equalMask16(a1 - i - 15, a2 - i - 15) & 0xffff;
+
+		if (mismatch)
+			return i + std::countl_zero(mismatch << 16);
 	}
+#endif
+	for (; i < a3 && a1[-i] == a2[-i]; ++i);
+
 	return i;
 }
 
@@ -22,40 +80,385 @@ static int CompressBackward_sub1(const u8 *a1, int a2, const u8 *a3, int a4, int
 {
 	u8 v10 = a1[a2 - 1];
 	int v7 = 0;
-	for (int i = 0; i < a4; ++i)
+
+	auto check = [&](int i)
 	{
+		int v6 = i + 1;
+		if (i + 1 > a2)
+			v6 = a2;
+		int v8 = CompressBackward_sub2(&a1[a2 - 1], &a3[i], v6);
+		if (v7 < v8)
+		{
+			v7 = v8;
+			a5 = i;
+		}
+	};
+
+	int i = 0;
+#ifdef __SSE2__
+	// Find the candidates in bulk, visiting them in increasing order
+	if (hasAvx2)
+	{
+		for (; i + 32 <= a4; i += 32)
+			for (u32 mask = findMask32(&a3[i], v10); mask; mask &= mask - 1)
+				check(i + std::countr_zero(mask));
+	}
+
+	for (; i + 16 <= a4; i += 16)
+		for (u32 mask = findMask16(&a3[i], v10); mask; mask &= mask - 1)
+			check(i + std::countr_zero(mask));
+#endif
+	for (; i < a4; ++i)
 		if (a3[i] == v10)
+			check(i);
+
+	return v7;
+}
+
+/**
+ * @brief Match finder that scans the whole window for every position.
+ */
+class WindowScan
+{
+	const u8* src;
+	size_t size;
+
+public:
+	WindowScan(const u8* src, size_t size):
+		src(src),
+		size(size)
+	{}
+
+	int find(size_t pos, int& offset)
+	{
+		const int maxLength = std::min<size_t>(pos, 18);
+		const int window = std::min<size_t>(size - pos, 4098);
+
+		return CompressBackward_sub1(&src[pos - maxLength], maxLength, &src[pos], window, offset);
+	}
+};
+
+/**
+ * @brief Match finder that only visits window positions
+ * whose next three bytes hash to the same value.
+ * 
+ * The chains are ordered by increasing distance, so with an
+ * unlimited depth the result is the same as with WindowScan.
+ */
+class HashChain
+{
+	static constexpr int hashBits = 16;
+	static constexpr s32 none = -1;
+
+	const u8* src;
+	size_t size;
+	size_t begin;
+	size_t inserted;
+	unsigned maxDepth;
+	std::vector<s32> ownHead;
+	std::vector<s32> ownPrev;
+	std::vector<s32>& head;
+	std::vector<s32>& prev; // indexed by position - begin
+
+	static u32 hash(const u8* p)
+	{
+		return (p[0] | p[-1] << 8 | p[-2] << 16) * 0x9e3779b1u >> (32 - hashBits);
+	}
+
+public:
+	/**
+	 * @param begin, end Only positions in [begin, end) are added to the chains.
+	 * The results of find(pos) are exact as long as begin <= pos and
+	 * end >= min(pos + 4098, size).
+	 */
+	HashChain(const u8* src, size_t size, unsigned maxDepth, size_t begin, size_t end):
+		HashChain(src, size, maxDepth, begin, end, ownHead, ownPrev)
+	{}
+
+	HashChain(const u8* src, size_t size, unsigned maxDepth):
+		HashChain(src, size, maxDepth, 0, size)
+	{}
+
+	/**
+	 * @param headStorage, prevStorage Vectors that hold the chains instead of the
+	 * HashChain itself, so that their memory can be reused. They must outlive it.
+	 */
+	HashChain(
+		const u8* src,
+		size_t size,
+		unsigned maxDepth,
+		size_t begin,
+		size_t end,
+		std::vector<s32>& headStorage,
+		std::vector<s32>& prevStorage
+	):
+		src(src),
+		size(size),
+		begin(begin),
+		inserted(end),
+		maxDepth(maxDepth),
+		head(headStorage),
+		prev(prevStorage)
+	{
+		// Every entry of prev is written before it is read
+		head.assign(1 << hashBits, none);
+		prev.resize(end - begin);
+	}
+
+	HashChain(const HashChain&) = delete;
+	HashChain& operator=(const HashChain&) = delete;
+
+	int find(size_t pos, int& offset)
+	{
+		// Make every position at least two bytes into the window searchable
+		while (inserted > pos + 2)
 		{
-			int v6 = i + 1;
-			if (i + 1 > a2)
-				v6 = a2;
-			int v8 = CompressBackward_sub2(&a1[a2 - 1], &a3[i], v6);
-			if (v7 < v8)
+			const u32 h = hash(&src[--inserted]);
+			prev[inserted - begin] = head[h];
+			head[h] = inserted;
+		}
+
+		const int maxLength = std::min<size_t>(pos, 18);
+
+		if (maxLength < 3)
+			return 0;
+
+		const size_t windowEnd = pos + std::min<size_t>(size - pos, 4098);
+		int bestLength = 0;
+		unsigned depth = 0;
+
+		for (s32 candidate = head[hash(&src[pos - 1])];
+			candidate != none && static_cast<size_t>(candidate) < windowEnd && depth < maxDepth;
+			candidate = prev[candidate - begin], ++depth)
+		{
+			const int distance = candidate - pos;
+			const int limit = std::min(distance + 1, maxLength);
+
+			// Skip candidates that cannot be longer than the best match so far
+			if (limit <= bestLength || src[candidate - bestLength] != src[pos - 1 - bestLength])
+				continue;
+
+			const int length = CompressBackward_sub2(&src[pos - 1], &src[candidate], limit);
+
+			if (bestLength < length)
 			{
-				v7 = v8;
-				a5 = i;
+				bestLength = length;
+				offset = distance;
+
+				if (length == maxLength)
+					break;
 			}
 		}
+
+		return bestLength;
 	}
-	return v7;
-}
+};
+
+/**
+ * @brief The matches that a HashChain finds at every position, computed
+ * in parallel.
+ * 
+ * The positions are split into segments, each of which gets its own hash chain
+ * covering the segment and the window above it, so the results are the same
+ * as those of a single HashChain.
+ * 
+ * If `parsed` is set, each segment only searches the positions that a greedy
+ * parse visits. The parse of a segment starts a bit above it, so it is almost
+ * always in sync with the actual parse by the time it enters the segment. The
+ * positions that were skipped but are visited by the actual parse are
+ * searched on demand.
+ * 
+ * Only positions up to `lastPosition` are searched in advance.
+ */
+class MatchTable
+{
+	struct Match
+	{
+		u16 offset;
+		u8 length;
+		bool found;
+	};
+
+	const u8* src;
+	size_t size;
+	unsigned maxDepth;
+	std::vector<Match> matches;
+	std::optional<HashChain> fallback;
+
+public:
+	MatchTable(const u8* src, size_t size, unsigned maxDepth, unsigned jobs, bool parsed, size_t lastPosition):
+		src(src),
+		size(size),
+		maxDepth(maxDepth),
+		matches(size + 1)
+	{
+		constexpr size_t minSegmentSize = 0x8000;
+		constexpr size_t parseOverlap = 0x100;
+
+		const size_t segmentCount = std::clamp<size_t>(lastPosition / minSegmentSize, 1, jobs * 4);
+		const size_t segmentSize = lastPosition / segmentCount + 1;
+
+		parallelFor(segmentCount, jobs, [&](size_t i)
+		{
+			// Positions go from 1 to lastPosition
+			const size_t segmentBegin = i * segmentSize + 1;
+			const size_t segmentEnd = std::min(segmentBegin + segmentSize, lastPosition + 1);
+
+			if (segmentBegin >= segmentEnd)
+				return;
+
+			const size_t searchEnd = parsed ? std::min(segmentEnd + parseOverlap, lastPosition + 1) : segmentEnd;
+			HashChain finder(src, size, maxDepth, segmentBegin, std::min(searchEnd + 4098, size));
+
+			for (size_t pos = searchEnd - 1; pos >= segmentBegin;)
+			{
+				int offset = 0;
+				const int length = finder.find(pos, offset);
+
+				if (pos < segmentEnd)
+					matches[pos] = {static_cast<u16>(offset), static_cast<u8>(length), true};
+
+				pos -= parsed && length > 2 ? length : 1;
+			}
+		});
+	}
+
+	int find(size_t pos, int& offset)
+	{
+		if (!matches[pos].found)
+		{
+			// The positions are visited in decreasing order, so a single chain will do
+			if (!fallback)
+				fallback.emplace(src, size, maxDepth, 0, std::min(pos + 4098, size));
+
+			int matchOffset = 0;
+			const int length = fallback->find(pos, matchOffset);
+
+			matches[pos] = {static_cast<u16>(matchOffset), static_cast<u8>(length), true};
+		}
+
+		offset = matches[pos].offset;
+		return matches[pos].length;
+	}
+};
+
+/**
+ * @brief Parser that picks the sequence of tokens with the lowest total
+ * cost, counting 9 bits per literal and 17 bits per match.
+ * 
+ * The cheapest way to encode the first n bytes doesn't depend on how the rest
+ * of the data was encoded, so the costs are computed from the start of the data
+ * and the chosen tokens are then read back from its end.
+ */
+class OptimalParse
+{
+	struct Token
+	{
+		u16 offset;
+		u8 length;
+	};
+
+	std::vector<Token> tokens;
+
+public:
+	OptimalParse(const u8* src, size_t size, unsigned jobs):
+		tokens(size + 1)
+	{
+		MatchTable longest(src, size, ~0u, jobs, false, size);
+
+		std::vector<u32> cost(size + 1);
+		cost[0] = 0;
+
+		for (size_t pos = 1; pos <= size; ++pos)
+		{
+			int offset = 0;
+			const int longestLength = longest.find(pos, offset);
+
+			cost[pos] = cost[pos - 1] + 9;
+			tokens[pos] = {0, 1};
+
+			for (int length = 3; length <= longestLength; ++length)
+			{
+				if (cost[pos - length] + 17 <= cost[pos])
+				{
+					cost[pos] = cost[pos - length] + 17;
+					tokens[pos] = {static_cast<u16>(offset), static_cast<u8>(length)};
+				}
+			}
+		}
+	}
+
+	int find(size_t pos, int& offset)
+	{
+		offset = tokens[pos].offset;
+		return tokens[pos].length;
+	}
+};
+
+struct Token
+{
+	u16 offset;
+	u8 length; ///< 1 for a literal, 0 if unknown
+};
+
+/**
+ * @brief What can be reused from compressing a previous version of the data.
+ */
+struct Replay
+{
+	std::vector<Token> tokens; ///< known tokens, indexed by their distance from the end
+
+	// The end of the previous compressed stream, made of whole flag groups,
+	// and the number of uncompressed bytes that it covers
+	std::span<const u8> stream;
+	size_t streamSource = 0;
+
+	// State of the in-place cut after the stream, as distances from the end
+	ptrdiff_t maxGain = 0;
+	size_t cutSrcDistance = 0;
+	size_t cutDstDistance = 0;
+};
 
 /**
  * @brief Compress module data.
  * 
+ * The compressed stream only covers src[rawSize, size): when decompressing in
+ * place, the tokens below that point would overwrite input that hasn't been
+ * read yet, so those bytes are stored as is instead. The cut is placed where
+ * (v12 - v13) is largest, which also makes the output as small as possible.
+ * 
  * @param src Pointer to input data begin.
  * @param size Size of the input data.
  * @param dst Pointer to output data begin.
+ * @param rawSize Set to the number of bytes at the beginning that must be stored as is.
+ * @param finder The match finder to use.
+ * @param replay The compressed stream to start from, see Replay.
  * 
- * @return The number of compressed bytes. (in_size - out_size)
+ * @return The offset of the compressed stream in dst, or -1 on failure.
  */
-static size_t CompressBackward(const void *src, size_t size, void *dst)
+template<class MatchFinder>
+static size_t CompressBackward(
+	const void *src,
+	size_t size,
+	void *dst,
+	size_t& rawSize,
+	MatchFinder& finder,
+	const Replay& replay
+)
 {
 	const u8* src_ = reinterpret_cast<const u8*>(src);
 	u8* dst_ = reinterpret_cast<u8*>(dst);
 
-	size_t v13 = size;
-	size_t v12 = size;
+	size_t v13 = size - replay.streamSource;
+	size_t v12 = size - replay.stream.size();
+
+	if (!replay.stream.empty())
+		std::memcpy(dst_ + v12, replay.stream.data(), replay.stream.size());
+
+	ptrdiff_t maxGain = replay.maxGain;
+	size_t cutSrc = size - replay.cutSrcDistance;
+	size_t cutDst = size - replay.cutDstDistance;
+
 	while (v13 > 0)
 	{
 		if (v12 <= 0)
@@ -67,18 +470,8 @@ static size_t CompressBackward(const void *src, size_t size, void *dst)
 			v11 *= 2;
 			if (v13 > 0)
 			{
-				const u8* v9 = &src_[v13];
-				int v8 = size - v13;
-				int v2 = v13;
-				if (v13 > 18)
-					v2 = 18;
-				int v6 = v2;
-				const u8* v7 = &v9[-v2];
-				int v1 = v8;
-				if (v8 > 4098)
-					v1 = 4098;
 				int v5;
-				int v4 = CompressBackward_sub1(v7, v6, v9, v1, v5);
+				int v4 = finder.find(v13, v5);
 				if (v4 <= 2)
 				{
 					if (v12 <= 0)
@@ -97,39 +490,355 @@ static size_t CompressBackward(const void *src, size_t size, void *dst)
 					dst_[v12] = v3;
 					v11 |= 1;
 				}
+
+				if (const ptrdiff_t gain = v12 - v13; gain >= maxGain)
+				{
+					maxGain = gain;
+					cutSrc = v13;
+					cutDst = v12;
+				}
 			}
 		}
 		dst_[v10] = v11;
 	}
-	return v12;
+	rawSize = cutSrc;
+	return cutDst;
+}
+
+/**
+ * @brief Match finder that returns known tokens where it can and
+ * asks another finder for the rest.
+ * 
+ * The known tokens are indexed by their distance from the end of the data.
+ */
+template<class MatchFinder>
+class ReplayFinder
+{
+	const std::vector<Token>& tokens;
+	size_t size;
+	MatchFinder& finder;
+
+public:
+	ReplayFinder(const std::vector<Token>& tokens, size_t size, MatchFinder& finder):
+		tokens(tokens),
+		size(size),
+		finder(finder)
+	{}
+
+	int find(size_t pos, int& offset)
+	{
+		const size_t distance = size - pos;
+
+		if (distance < tokens.size() && tokens[distance].length)
+		{
+			offset = tokens[distance].offset;
+			return tokens[distance].length;
+		}
+
+		return finder.find(pos, offset);
+	}
+};
+
+/**
+ * @brief Get the length of the longest common suffix of two byte arrays.
+ */
+static size_t commonSuffixLength(std::span<const u8> a, std::span<const u8> b)
+{
+	constexpr size_t blockSize = 64;
+
+	const size_t maxLength = std::min(a.size(), b.size());
+	const u8* aEnd = a.data() + a.size();
+	const u8* bEnd = b.data() + b.size();
+	size_t length = 0;
+
+	while (length + blockSize <= maxLength
+		&& std::memcmp(aEnd - length - blockSize, bEnd - length - blockSize, blockSize) == 0)
+	{
+		length += blockSize;
+	}
+
+	while (length < maxLength && aEnd[-1 - length] == bEnd[-1 - length])
+		++length;
+
+	return length;
+}
+
+/**
+ * @brief Get what compressing data can reuse from compressing previousData.
+ * 
+ * The token at a distance r from the end of the data only depends on the bytes at distances
+ * from r - 4098 to r + 18, so it stays the same as long as r + 18 doesn't exceed the length of
+ * the common suffix. Flag groups made only of such tokens are copied as they are.
+ * This only holds for the greedy parse, not for the `max` level.
+ * 
+ * @return The reusable part of the previous parse, or nothing if the compressed
+ * data doesn't match previousData.
+ */
+static Replay reusableParse(
+	std::span<const u8> data,
+	std::span<const u8> previousData,
+	std::span<const u8> previousCompressed
+)
+{
+	const size_t suffixLength = commonSuffixLength(data, previousData);
+	const size_t compressedSize = previousCompressed.size();
+	const size_t previousSize = previousData.size();
+
+	if (suffixLength <= 18 || compressedSize < 8)
+		return {};
+
+	const u32 offsetIn = readU32(&previousCompressed[compressedSize - 8]);
+	const size_t streamBegin = compressedSize - std::min<size_t>(offsetIn & 0xffffff, compressedSize);
+	const size_t streamEnd = compressedSize - std::min<size_t>(offsetIn >> 24, compressedSize);
+
+	if (streamEnd < streamBegin || compressedSize + readU32(&previousCompressed[compressedSize - 4]) != previousSize)
+		return {};
+
+	const size_t knownDistance = suffixLength - 18;
+	const u8* previous = previousData.data();
+
+	Replay replay;
+	replay.tokens.resize(knownDistance);
+
+	ptrdiff_t maxGain = 0;
+	size_t cutSrcDistance = 0;
+	size_t cutDstDistance = 0;
+
+	size_t in = streamEnd;
+	size_t distance = 0;
+
+	// Read the tokens like the decoder, checking that they reproduce previousData
+	while (in > streamBegin && distance < knownDistance)
+	{
+		u8 flags = previousCompressed[--in];
+		int i = 0;
+
+		for (; i < 8 && in > streamBegin && distance < knownDistance; ++i, flags <<= 1)
+		{
+			const size_t pos = previousSize - distance;
+			Token& token = replay.tokens[distance];
+
+			if (flags & 0x80)
+			{
+				if (in - streamBegin < 2)
+					return {};
+
+				in -= 2;
+				const u16 value = previousCompressed[in + 1] << 8 | previousCompressed[in];
+				token = {static_cast<u16>((value & 0xfff) + 2), static_cast<u8>((value >> 12) + 3)};
+
+				// The decoder copies byte by byte, so this also holds for overlapping matches
+				if (token.length > pos || pos + token.offset >= previousSize
+					|| std::memcmp(previous + pos - token.length, previous + pos - token.length + token.offset + 1, token.length))
+				{
+					return {};
+				}
+			}
+			else
+			{
+				token = {0, 1};
+
+				if (previousCompressed[--in] != previous[pos - 1])
+					return {};
+			}
+
+			distance += token.length;
+
+			if (const ptrdiff_t gain = distance - (streamEnd - in); gain >= maxGain)
+			{
+				maxGain = gain;
+				cutSrcDistance = distance;
+				cutDstDistance = streamEnd - in;
+			}
+		}
+
+		// Only whole groups can be copied, and only as long as they fit in the output
+		if (i == 8 && streamEnd - in <= data.size())
+		{
+			replay.stream = {&previousCompressed[in], streamEnd - in};
+			replay.streamSource = distance;
+			replay.maxGain = maxGain;
+			replay.cutSrcDistance = cutSrcDistance;
+			replay.cutDstDistance = cutDstDistance;
+		}
+	}
+
+	// Everything below that was stored uncompressed
+	replay.tokens.resize(std::min(distance, knownDistance));
+
+	return replay;
+}
+
+/**
+ * @param replay The reusable part of a previous parse, see Replay.
+ * @param scratch Memory for the match finder.
+ */
+static size_t CompressBackward(
+	const void *src,
+	size_t size,
+	void *dst,
+	size_t& rawSize,
+	BLZ::Level level,
+	unsigned jobs,
+	const Replay& replay,
+	BLZ::Scratch& scratch
+)
+{
+	const u8* src_ = reinterpret_cast<const u8*>(src);
+
+	auto compressWith = [&]<class MatchFinder>(MatchFinder& finder)
+	{
+		ReplayFinder<MatchFinder> replayFinder(replay.tokens, size, finder);
+		return CompressBackward(src, size, dst, rawSize, replayFinder, replay);
+	};
+
+	// Every position that the parse visits above this one has a known token
+	const size_t lastPosition = size - std::min(replay.tokens.size(), size);
+
+	switch (level)
+	{
+	case BLZ::Level::fast:
+	case BLZ::Level::normal:
+	{
+		const unsigned maxDepth = level == BLZ::Level::fast ? 64 : ~0u;
+
+		if (jobs > 1)
+		{
+			MatchTable finder(src_, size, maxDepth, jobs, true, lastPosition);
+			return compressWith(finder);
+		}
+
+		HashChain finder(
+			src_, size, maxDepth, 0, std::min(lastPosition + 4098, size), scratch.chainHead, scratch.chainPrev
+		);
+		return compressWith(finder);
+	}
+	case BLZ::Level::max:
+	{
+		OptimalParse parser(src_, size, jobs);
+		return CompressBackward(src, size, dst, rawSize, parser, {});
+	}
+	case BLZ::Level::scan:
+	{
+		WindowScan finder(src_, size);
+		return compressWith(finder);
+	}
+	}
+
+	throw std::invalid_argument("invalid compression level");
+}
+
+template<std::size_t n>
+static void copyBytes(u8* dest, const u8* src)
+{
+	u8 tmp[n];
+	std::memcpy(tmp, src, n);
+	std::memcpy(dest, tmp, n);
+}
+
+/**
+ * @brief Copy a match to the bytes below `pOut`.
+ * 
+ * If the offset is at least 8, whole words are copied starting from the top.
+ * The last word is aligned to the bottom of the match, so nothing outside of
+ * it is written, and any bytes it shares with the previous word get the same
+ * values again.
+ */
+static void copyMatch(u8* pOut, u32 offset, u32 length)
+{
+	const u8* pTmp = pOut + offset;
+
+	if (offset < 8)
+	{
+		for (unsigned j = 0; j < length; ++j)
+			*--pOut = *--pTmp;
+	}
+	else if (length >= 8)
+	{
+		for (unsigned j = 8; j < length; j += 8)
+			copyBytes<8>(pOut - j, pTmp - j);
+
+		copyBytes<8>(pOut - length, pTmp - length);
+	}
+	else if (length >= 4)
+	{
+		copyBytes<4>(pOut - 4, pTmp - 4);
+		copyBytes<4>(pOut - length, pTmp - length);
+	}
+	else
+	{
+		copyBytes<2>(pOut - 2, pTmp - 2);
+		pOut[-3] = pTmp[-3];
+	}
 }
 
 /**
  * @brief Uncompress module data.
  * 
  * @param bottom Pointer to input data end.
+ * @param end Pointer to the end of the buffer. Matches may not refer to anything past it.
  */
-static void UncompressBackward(void* bottom)
+static void UncompressBackward(void* bottom, const u8* end)
 {
 	u32 offsetOut   = readU32(static_cast<u8*>(bottom) - 4);
 	u32 offsetIn    = readU32(static_cast<u8*>(bottom) - 8);
 	u32 offsetInBtm = offsetIn >> 24;
 	u32 offsetInTop = offsetIn & 0xFFFFFF;
 
+	if (offsetOut > static_cast<std::size_t>(end - static_cast<u8*>(bottom)))
+		throw std::runtime_error(DEST_OVERRUN);
+
 	u8* pOut   = reinterpret_cast<u8*>(bottom) + offsetOut;
 	u8* pInBtm = reinterpret_cast<u8*>(bottom) - offsetInBtm;
 	u8* pInTop = reinterpret_cast<u8*>(bottom) - offsetInTop;
 
+	// A group of 8 tokens reads at most 17 bytes and writes at most 144 bytes,
+	// so none of the checks below can fail as long as both pointers are further
+	// than that from pInTop.
+	while (pInBtm - pInTop > 17 && pOut - pInTop > 144)
+	{
+		u8 flag = *--pInBtm;
+
+		// Copy 8 literals at once if the input and output don't overlap
+		if (flag == 0 && (pOut - pInBtm >= 8 || pInBtm - pOut >= 8))
+		{
+			pOut -= 8;
+			pInBtm -= 8;
+			copyBytes<8>(pOut, pInBtm);
+			continue;
+		}
+
+		for (int i = 0; i < 8; ++i, flag <<= 1)
+		{
+			if (!(flag & 0x80))
+			{
+				*--pOut = *--pInBtm;
+			}
+			else
+			{
+				u32 length = *--pInBtm;
+				u32 offset = (((length & 0xF) << 8) | (*--pInBtm)) + 3;
+				length = (length >> 4) + 3;
+
+				if (offset > static_cast<std::size_t>(end - pOut))
+					throw std::runtime_error(DEST_OVERRUN);
+
+				copyMatch(pOut, offset, length);
+				pOut -= length;
+			}
+		}
+	}
+
 	while (pInTop < pInBtm)
 	{
 		u8 flag = *--pInBtm;
 
 		for (int i = 0; i < 8; ++i)
 		{
-			if (pInBtm < pInTop)
+			if (pInBtm <= pInTop)
 				throw std::runtime_error(SRC_SHORTAGE);
 
-			if (pOut < pInTop)
+			if (pOut <= pInTop)
 				throw std::runtime_error(DEST_OVERRUN);
 
 			if (!(flag & 0x80))
@@ -145,11 +854,11 @@ static void UncompressBackward(void* bottom)
 				u32 offset = (((length & 0xF) << 8) | (*--pInBtm)) + 3;
 				length = (length >> 4) + 3;
 
-				u8* pTmp = pOut + offset;
-
-				if (pOut - length < pInTop)
+				if (offset > static_cast<std::size_t>(end - pOut) || pOut - length < pInTop)
 					throw std::runtime_error(DEST_OVERRUN);
 
+				u8* pTmp = pOut + offset;
+
 				for (unsigned j = 0; j < length; ++j)
 					*--pOut = *--pTmp;
 			}
@@ -162,32 +871,93 @@ static void UncompressBackward(void* bottom)
 	}
 }
 
+/**
+ * @brief Check that the compressed region given by the footer is inside the data.
+ */
+static void checkFooter(std::span<const u8> data)
+{
+	if (data.size() < 8)
+		throw std::runtime_error(SRC_SHORTAGE);
+
+	const u32 offsetIn = readU32(&data[data.size() - 8]);
+
+	if ((offsetIn & 0xFFFFFF) > data.size() || (offsetIn >> 24) > (offsetIn & 0xFFFFFF))
+		throw std::runtime_error(SRC_SHORTAGE);
+}
+
+static constexpr const char* levelNames[] = {"fast", "normal", "max", "scan"};
+
 namespace BLZ
 {
-	std::vector<u8> compress(const std::vector<u8>& data, u8 padding)
+	const char* levelName(Level level)
+	{
+		return levelNames[static_cast<int>(level)];
+	}
+
+	bool parseLevel(std::string_view name, Level& level)
+	{
+		for (int i = 0; i < static_cast<int>(std::size(levelNames)); ++i)
+		{
+			if (name == levelNames[i])
+			{
+				level = static_cast<Level>(i);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	static size_t compress(
+		std::span<const u8> data,
+		std::span<u8> output,
+		Scratch& scratch,
+		u8 padding,
+		Level level,
+		unsigned jobs,
+		const Replay& replay
+	)
 	{
 		const size_t dataSize = data.size();
-		std::vector<u8> dest(dataSize);
 
-		const size_t reduction = CompressBackward(data.data(), dataSize, dest.data());
+		// The stream is written downwards from the end of a buffer as large as the input.
+		// If the output is that large, it is used as that buffer and the stream is moved down.
+		u8* stream = output.data();
+
+		if (output.size() < dataSize)
+		{
+			scratch.stream.resize(dataSize);
+			stream = scratch.stream.data();
+		}
+
+		size_t rawSize;
+		const size_t streamOffset = CompressBackward(data.data(), dataSize, stream, rawSize, level, jobs, replay, scratch);
+
+		if (streamOffset == (size_t)-1)
+			throw std::runtime_error("compression failed");
+
+		const size_t streamSize = dataSize - streamOffset;
+		const size_t paddingSize = -(rawSize + streamSize) & 3;
+		const size_t footerOffset = rawSize + streamSize + paddingSize;
+		const size_t compressedSize = footerOffset + 8;
 
-		if (reduction == (size_t)-1)
+		if (compressedSize > dataSize)
 			throw std::runtime_error("compression failed");
 
-		const ptrdiff_t destSize = dest.size() - reduction;
-		std::memmove(dest.data(), dest.data() + reduction, destSize);
+		if (compressedSize > output.size())
+			throw std::length_error("output buffer too small for compressed data");
 
-		const size_t paddingSize = -destSize & 3;
-		const size_t footerOffset = destSize + paddingSize;
+		u8* dest = output.data();
 
-		dest.resize(footerOffset + 8);
-		std::memset(dest.data() + destSize, padding, paddingSize);
+		std::memmove(dest + rawSize, stream + streamOffset, streamSize);
+		std::copy_n(data.data(), rawSize, dest);
+		std::memset(dest + rawSize + streamSize, padding, paddingSize);
 
-		// full compressed size, including padding and footer
-		const size_t offset1 = dest.size();
+		// compressed size, including padding and footer but not the raw bytes in front
+		const size_t offset1 = compressedSize - rawSize;
 
 		// (uncompressed size) - (full compressed size, including padding and footer)
-		const size_t offset2 = reduction - paddingSize - 8;
+		const size_t offset2 = dataSize - compressedSize;
 
 		dest[footerOffset]     =  offset1        & 0xff;
 		dest[footerOffset + 1] = (offset1 >>  8) & 0xff;
@@ -198,33 +968,160 @@ namespace BLZ
 		dest[footerOffset + 6] = (offset2 >> 16) & 0xff;
 		dest[footerOffset + 7] = (offset2 >> 24) & 0xff;
 
+		return compressedSize;
+	}
+
+	size_t compress(
+		std::span<const u8> data,
+		std::span<u8> output,
+		Scratch& scratch,
+		u8 padding,
+		Level level,
+		unsigned jobs
+	)
+	{
+		return compress(data, output, scratch, padding, level, jobs, {});
+	}
+
+	std::vector<u8> compress(const std::vector<u8>& data, u8 padding, Level level, unsigned jobs)
+	{
+		Scratch scratch;
+		std::vector<u8> dest(compressBound(data.size()));
+
+		dest.resize(compress(data, dest, scratch, padding, level, jobs, {}));
+
 		return dest;
 	}
 
-	std::vector<u8> uncompress(const std::vector<u8>& data)
+	size_t recompress(
+		std::span<const u8> data,
+		std::span<const u8> previousData,
+		std::span<const u8> previousCompressed,
+		std::span<u8> output,
+		Scratch& scratch,
+		u8 padding,
+		Level level,
+		unsigned jobs
+	)
 	{
-		size_t dataSize = data.size();
-		u32 destSize = dataSize + readU32(&data[dataSize - 4]);
+		// The optimal parse doesn't build on the tokens above the current one
+		const Replay replay = level == Level::max ? Replay{} : reusableParse(data, previousData, previousCompressed);
 
-		std::vector<u8> dest(destSize);
-		std::copy(data.begin(), data.end(), dest.begin());
-		
-		UncompressBackward(dest.data() + dataSize);
+		return compress(data, output, scratch, padding, level, jobs, replay);
+	}
+
+	std::vector<u8> recompress(
+		const std::vector<u8>& data,
+		const std::vector<u8>& previousData,
+		const std::vector<u8>& previousCompressed,
+		u8 padding,
+		Level level,
+		unsigned jobs
+	)
+	{
+		Scratch scratch;
+		std::vector<u8> dest(compressBound(data.size()));
+
+		dest.resize(recompress(data, previousData, previousCompressed, dest, scratch, padding, level, jobs));
+
+		return dest;
+	}
+
+	size_t uncompressedSize(std::span<const u8> data)
+	{
+		checkFooter(data);
+
+		return data.size() + readU32(&data[data.size() - 4]);
+	}
+
+	bool validate(std::span<const u8> data)
+	{
+		if (data.size() < 8)
+			return false;
+
+		const u32 offsetIn = readU32(&data[data.size() - 8]);
+		const std::size_t end = data.size() + readU32(&data[data.size() - 4]);
+
+		if ((offsetIn & 0xFFFFFF) > data.size() || (offsetIn >> 24) > (offsetIn & 0xFFFFFF))
+			return false;
+
+		// The same positions as in UncompressBackward, but nothing is written
+		const std::size_t inTop = data.size() - (offsetIn & 0xFFFFFF);
+		std::size_t inBtm = data.size() - (offsetIn >> 24);
+		std::size_t out = end;
+
+		while (inTop < inBtm)
+		{
+			u8 flag = data[--inBtm];
+
+			for (int i = 0; i < 8; ++i, flag <<= 1)
+			{
+				if (inBtm <= inTop || out <= inTop)
+					return false;
+
+				if (!(flag & 0x80))
+				{
+					--inBtm;
+					--out;
+				}
+				else
+				{
+					if (inBtm - inTop < 2)
+						return false;
+
+					inBtm -= 2;
+					const u32 offset = (((data[inBtm + 1] & 0xF) << 8) | data[inBtm]) + 3;
+					const u32 length = (data[inBtm + 1] >> 4) + 3;
+
+					if (offset > end - out || out - inTop < length)
+						return false;
+
+					out -= length;
+				}
+
+				// The output may not overwrite input that wasn't read yet
+				if (out < inBtm)
+					return false;
+
+				if (inBtm <= inTop)
+					break;
+			}
+		}
+
+		return out == inTop;
+	}
+
+	size_t uncompress(std::span<const u8> data, std::span<u8> output)
+	{
+		const size_t destSize = uncompressedSize(data);
+
+		if (output.size() < destSize)
+			throw std::length_error("output buffer too small for uncompressed data");
+
+		std::memmove(output.data(), data.data(), data.size());
+		UncompressBackward(output.data() + data.size(), output.data() + destSize);
+
+		return destSize;
+	}
+
+	std::vector<u8> uncompress(const std::vector<u8>& data)
+	{
+		std::vector<u8> dest(uncompressedSize(data));
+		uncompress(data, dest);
 
 		return dest;
 	}
 
 	void uncompressInplace(std::vector<u8>& data)
 	{
-		size_t dataSize = data.size();
-		u32 destSize = dataSize + readU32(&data[dataSize - 4]);
-		data.resize(destSize);
-		
-		UncompressBackward(data.data() + dataSize);
+		const size_t dataSize = data.size();
+		data.resize(uncompressedSize(data));
+
+		UncompressBackward(data.data() + dataSize, data.data() + data.size());
 	}
 
 	void uncompressInplace(u8* data_end)
 	{
-		UncompressBackward(data_end);
+		UncompressBackward(data_end, data_end + readU32(data_end - 4));
 	}
 }
@@ -1,18 +1,176 @@
 #pragma once
 
 #include <vector>
+#include <span>
+#include <string_view>
 #include "common.h"
 
 namespace BLZ
 {
+	enum class Level : u8
+	{
+		fast,   ///< Greedy parse with a depth-limited hash chain search.
+		normal, ///< Greedy parse with a full hash chain search. Same output as `scan`.
+		max,    ///< Optimal parse. Smallest output, but slower than `normal`.
+		scan    ///< Greedy parse with an exhaustive window scan, like the original compressor. Slow, kept as a reference.
+	};
+
+	/**
+	 * @brief The version of the compressor's output, which is part of the cache key.
+	 * It has to be bumped whenever the same input may be compressed differently.
+	 * 
+	 * 2: The compressed stream starts where uncompressing in place is safe and the output is smallest.
+	 *    This changes the output of every level for some inputs, including some whose previous output
+	 *    could already be uncompressed in place, so it no longer matches the original compressor.
+	 */
+	inline constexpr unsigned version = 2;
+
+	/**
+	 * @brief Get the name of a compression level as used in the config file.
+	 */
+	const char* levelName(Level level);
+
+	/**
+	 * @brief Get a compression level by its name.
+	 * 
+	 * @param name The name of the level.
+	 * @param level Receives the level if the name is valid.
+	 * 
+	 * @return Whether the name is valid.
+	 */
+	bool parseLevel(std::string_view name, Level& level);
+
+	/**
+	 * @brief Memory that is reused between calls to compress.
+	 * 
+	 * Compressing many files with the same Scratch avoids allocating for
+	 * each of them. A Scratch must not be used by several threads at once.
+	 */
+	struct Scratch
+	{
+		std::vector<u8> stream;
+		std::vector<s32> chainHead;
+		std::vector<s32> chainPrev;
+	};
+
+	/**
+	 * @brief Get the largest possible size of the compressed data.
+	 * 
+	 * Data that doesn't get smaller can't be compressed, so this is the input size.
+	 */
+	constexpr std::size_t compressBound(std::size_t size)
+	{
+		return size;
+	}
+
+	/**
+	 * @brief Compress module data into a given buffer.
+	 * 
+	 * @param data The data to compress.
+	 * @param output Receives the compressed data. Must not overlap data. If it is at least
+	 * as large as data, it is also used as working memory and the scratch stream isn't used.
+	 * @param scratch Working memory.
+	 * @param padding The byte used to pad the compressed data to a multiple of 4 bytes.
+	 * @param level The compression level.
+	 * @param jobs The maximum number of threads used to search for matches.
+	 * The output doesn't depend on it.
+	 * 
+	 * @return The size of the compressed data.
+	 * @throw std::length_error if the compressed data doesn't fit in output.
+	 */
+	std::size_t compress(
+		std::span<const u8> data,
+		std::span<u8> output,
+		Scratch& scratch,
+		u8 padding = 0xff,
+		Level level = Level::normal,
+		unsigned jobs = 1
+	);
+
 	/**
 	 * @brief Compress module data.
 	 * 
 	 * @param data The data to compress.
+	 * @param padding The byte used to pad the compressed data to a multiple of 4 bytes.
+	 * @param level The compression level.
+	 * @param jobs The maximum number of threads used to search for matches.
+	 * The output doesn't depend on it.
 	 * 
 	 * @return The compressed data.
 	 */
-	std::vector<u8> compress(const std::vector<u8>& data, u8 padding = 0xff);
+	std::vector<u8> compress(const std::vector<u8>& data, u8 padding = 0xff, Level level = Level::normal, unsigned jobs = 1);
+
+	/**
+	 * @brief Compress module data that was compressed before with a different beginning.
+	 * 
+	 * The data is compressed from the end backwards, so the matches near the end
+	 * are taken from the previous compressed data instead of being searched for
+	 * again. The result is the same as that of `compress`. With the `max` level,
+	 * which doesn't parse greedily, nothing is reused.
+	 * 
+	 * @param data The data to compress.
+	 * @param previousData The previous version of the data.
+	 * @param previousCompressed The result of compressing previousData with the same level.
+	 * If it doesn't match previousData, the data is compressed from scratch.
+	 * @param padding The byte used to pad the compressed data to a multiple of 4 bytes.
+	 * @param level The compression level.
+	 * @param jobs The maximum number of threads used to search for matches.
+	 * 
+	 * @return The compressed data.
+	 */
+	std::vector<u8> recompress(
+		const std::vector<u8>& data,
+		const std::vector<u8>& previousData,
+		const std::vector<u8>& previousCompressed,
+		u8 padding = 0xff,
+		Level level = Level::normal,
+		unsigned jobs = 1
+	);
+
+	/**
+	 * @brief Like recompress, but into a given buffer, see the
+	 * corresponding overload of compress.
+	 * 
+	 * @return The size of the compressed data.
+	 */
+	std::size_t recompress(
+		std::span<const u8> data,
+		std::span<const u8> previousData,
+		std::span<const u8> previousCompressed,
+		std::span<u8> output,
+		Scratch& scratch,
+		u8 padding = 0xff,
+		Level level = Level::normal,
+		unsigned jobs = 1
+	);
+
+	/**
+	 * @brief Get the size of module data after uncompressing it.
+	 * 
+	 * @param data The compressed data.
+	 */
+	std::size_t uncompressedSize(std::span<const u8> data);
+
+	/**
+	 * @brief Check whether data is complete, valid module data without uncompressing it.
+	 * 
+	 * Every token is checked against the bounds of the data, and the stream has to
+	 * end exactly where the uncompressed part of the data begins.
+	 * 
+	 * @param data The data to check.
+	 */
+	bool validate(std::span<const u8> data);
+
+	/**
+	 * @brief Uncompress module data into a given buffer.
+	 * 
+	 * @param data The data to uncompress. It may be at the beginning of output.
+	 * @param output Receives the decompressed data.
+	 * 
+	 * @return The size of the decompressed data.
+	 * @throw std::length_error if output is smaller than uncompressedSize(data).
+	 */
+	std::size_t uncompress(std::span<const u8> data, std::span<u8> output);
 
 	/**
 	 * @brief Uncompress module data.
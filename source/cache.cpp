@@ -0,0 +1,117 @@
+#include "cache.h"
+#include "hash.h"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+
+static std::string hashString(std::span<const u8> data)
+{
+	std::stringstream s;
+	s << std::hex << std::setfill('0') << std::setw(16) << hash64(data.data(), data.size());
+
+	return s.str();
+}
+
+static bool readEntry(const fs::path& entryPath, std::vector<u8>& data)
+{
+	std::error_code ec;
+	const auto size = fs::file_size(entryPath, ec);
+
+	if (ec)
+		return false;
+
+	std::ifstream file(entryPath, std::ios::binary | std::ios::in);
+	data.resize(size);
+
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(data.data()), size));
+}
+
+fs::path CompressionCache::entryPath(std::span<const u8> data, BLZ::Level level, u8 padding) const
+{
+	const std::string hash = hashString(data);
+
+	std::stringstream s;
+	s << hash.substr(2) << '-' << data.size() << '-' << BLZ::levelName(level);
+	s << '-' << std::hex << std::setfill('0') << std::setw(2) << static_cast<u32>(padding) << ".bin";
+
+	// Entries of older versions of the compressor are never used
+	return dir / ("blz-v" + std::to_string(BLZ::version)) / hash.substr(0, 2) / s.str();
+}
+
+bool CompressionCache::load(const fs::path& entryPath, std::size_t uncompressedSize, std::vector<u8>& compressedData) const
+{
+	if (!readEntry(entryPath, compressedData) || compressedData.size() < 8)
+		return false;
+
+	// The footer stores how much larger the uncompressed data is
+	const std::size_t size = compressedData.size();
+
+	return size + readU32(&compressedData[size - 4]) == uncompressedSize;
+}
+
+fs::path CompressionCache::entryPath(std::span<const u8> data, Codec::Format format) const
+{
+	const std::string hash = hashString(data);
+
+	// Entries of older versions of the compressor are never used
+	return dir / (Codec::formatName(format) + ("-v" + std::to_string(Codec::version))) / hash.substr(0, 2)
+		/ (hash.substr(2) + '-' + std::to_string(data.size()) + ".bin");
+}
+
+bool CompressionCache::load(
+	const fs::path& entryPath,
+	Codec::Format format,
+	std::size_t uncompressedSize,
+	std::vector<u8>& compressedData
+) const
+{
+	return readEntry(entryPath, compressedData)
+		&& Codec::detect(compressedData) == format
+		&& Codec::uncompressedSize(compressedData) == uncompressedSize;
+}
+
+static void writeAtomically(const fs::path& path, std::span<const u8> data)
+{
+	std::error_code ec;
+	fs::create_directories(path.parent_path(), ec);
+
+	if (ec) return;
+
+	fs::path tempPath = path;
+	tempPath += '.' + std::to_string(std::random_device{}()) + ".tmp";
+
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::out);
+
+		if (!file.is_open())
+			return;
+
+		if (!file.write(reinterpret_cast<const char*>(data.data()), data.size()))
+		{
+			file.close();
+			fs::remove(tempPath, ec);
+			return;
+		}
+	}
+
+	fs::rename(tempPath, path, ec);
+
+	if (ec) fs::remove(tempPath, ec);
+}
+
+void CompressionCache::store(const fs::path& entryPath, std::span<const u8> compressedData) const
+{
+	writeAtomically(entryPath, compressedData);
+}
+
+bool CompressionCache::loadPrevious(const fs::path& path, std::vector<u8>& data) const
+{
+	return readEntry(dir / "previous" / path, data);
+}
+
+void CompressionCache::storePrevious(const fs::path& path, std::span<const u8> data) const
+{
+	writeAtomically(dir / "previous" / path, data);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+#include "blz.hpp"
+#include "codec.h"
+
+#include <span>
+
+/**
+ * @brief Persistent store of compressed files, keyed by a hash of the
+ * uncompressed data and the compression parameters.
+ * 
+ * Entries are written atomically, so multiple neondst processes can share
+ * the same cache directory.
+ * 
+ * The cache also keeps the last uncompressed version of each file that was
+ * compressed, so that the next version can be recompressed incrementally.
+ */
+class CompressionCache
+{
+	fs::path dir;
+
+public:
+	CompressionCache(const fs::path& dir):
+		dir(dir)
+	{}
+
+	/**
+	 * @brief Get the path of the cache entry for the given data, which also depends on BLZ::version.
+	 */
+	fs::path entryPath(std::span<const u8> data, BLZ::Level level, u8 padding) const;
+
+	/**
+	 * @brief Load a cache entry.
+	 * 
+	 * @param entryPath The path of the entry.
+	 * @param uncompressedSize The size of the uncompressed data.
+	 * @param compressedData Receives the compressed data.
+	 * 
+	 * @return Whether a valid entry was found.
+	 */
+	bool load(const fs::path& entryPath, std::size_t uncompressedSize, std::vector<u8>& compressedData) const;
+
+	/**
+	 * @brief Get the path of the cache entry for data compressed with one of the BIOS formats,
+	 * which also depends on Codec::version.
+	 */
+	fs::path entryPath(std::span<const u8> data, Codec::Format format) const;
+
+	/**
+	 * @brief Load a cache entry of data compressed with one of the BIOS formats.
+	 * 
+	 * @param entryPath The path of the entry.
+	 * @param format The compression format.
+	 * @param uncompressedSize The size of the uncompressed data.
+	 * @param compressedData Receives the compressed data.
+	 * 
+	 * @return Whether a valid entry was found.
+	 */
+	bool load(
+		const fs::path& entryPath,
+		Codec::Format format,
+		std::size_t uncompressedSize,
+		std::vector<u8>& compressedData
+	) const;
+
+	/**
+	 * @brief Store a cache entry. Failures are ignored.
+	 * 
+	 * @param entryPath The path of the entry.
+	 * @param compressedData The compressed data.
+	 */
+	void store(const fs::path& entryPath, std::span<const u8> compressedData) const;
+
+	/**
+	 * @brief Load the last uncompressed version of a file that was stored.
+	 * 
+	 * @param path The path of the file, relative to `modified/to-be-compressed`.
+	 * @param data Receives the data.
+	 * 
+	 * @return Whether a previous version was found.
+	 */
+	bool loadPrevious(const fs::path& path, std::vector<u8>& data) const;
+
+	/**
+	 * @brief Store the uncompressed version of a file. Failures are ignored.
+	 * 
+	 * @param path The path of the file, relative to `modified/to-be-compressed`.
+	 * @param data The uncompressed data.
+	 */
+	void storePrevious(const fs::path& path, std::span<const u8> data) const;
+};
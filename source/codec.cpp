@@ -0,0 +1,559 @@
+#include "codec.h"
+#include "blz.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static const char* SRC_SHORTAGE = "Source shortage.";
+static const char* INVALID_MATCH = "Match before the beginning of the data.";
+
+static constexpr const char* formatNames[] = {"none", "lz10", "lz11", "huffman", "rle", "blz"};
+
+struct Header
+{
+	Codec::Format format;
+	std::size_t size;       ///< uncompressed size
+	std::size_t headerSize; ///< 4, or 8 if the size doesn't fit in 24 bits
+};
+
+static Codec::Format formatFromType(u8 type)
+{
+	switch (type)
+	{
+	case 0x10: return Codec::Format::lz10;
+	case 0x11: return Codec::Format::lz11;
+	case 0x24:
+	case 0x28: return Codec::Format::huffman;
+	case 0x30: return Codec::Format::rle;
+	default:   return Codec::Format::none;
+	}
+}
+
+static Header readHeader(std::span<const u8> data)
+{
+	if (data.size() < 4)
+		throw std::runtime_error(SRC_SHORTAGE);
+
+	Header header = {formatFromType(data[0]), readU32(data.data()) >> 8, 4};
+
+	if (header.size == 0)
+	{
+		if (data.size() < 8)
+			throw std::runtime_error(SRC_SHORTAGE);
+
+		header.size = readU32(data.data() + 4);
+		header.headerSize = 8;
+	}
+
+	return header;
+}
+
+static void writeHeader(std::vector<u8>& out, u8 type, std::size_t size)
+{
+	if (size > 0xffffffff)
+		throw std::length_error("data too large to compress");
+
+	out.resize(size <= 0xffffff ? 4 : 8);
+
+	if (size <= 0xffffff)
+		writeU32(out.data(), type | size << 8);
+	else
+	{
+		writeU32(out.data(), type);
+		writeU32(out.data() + 4, size);
+	}
+}
+
+/**
+ * @brief Copy a match to `dst`, from `distance` bytes before it.
+ * 
+ * If the distance is at least 8, whole words are copied from the bottom, each
+ * of which only reads bytes that have already been written.
+ */
+static void copyMatch(u8* dst, std::size_t distance, std::size_t length)
+{
+	const u8* src = dst - distance;
+	std::size_t i = 0;
+
+	if (distance >= 8)
+	{
+		for (; i + 8 <= length; i += 8)
+		{
+			u8 tmp[8];
+			std::memcpy(tmp, src + i, 8);
+			std::memcpy(dst + i, tmp, 8);
+		}
+	}
+
+	for (; i < length; ++i)
+		dst[i] = src[i];
+}
+
+// The decoders return the offset of the end of the compressed stream in data
+
+static std::size_t uncompressLZ(std::span<const u8> data, std::size_t headerSize, std::span<u8> out, bool lz11)
+{
+	const u8* in = data.data() + headerSize;
+	const u8* const inEnd = data.data() + data.size();
+
+	u8* const outBegin = out.data();
+	u8* const outEnd = outBegin + out.size();
+	u8* dst = outBegin;
+
+	while (dst < outEnd)
+	{
+		if (in == inEnd)
+			throw std::runtime_error(SRC_SHORTAGE);
+
+		u8 flags = *in++;
+
+		// 8 literals at once
+		if (flags == 0 && inEnd - in >= 8 && outEnd - dst >= 8)
+		{
+			std::memcpy(dst, in, 8);
+			dst += 8;
+			in += 8;
+			continue;
+		}
+
+		for (int i = 0; i < 8 && dst < outEnd; ++i, flags <<= 1)
+		{
+			if (!(flags & 0x80))
+			{
+				if (in == inEnd)
+					throw std::runtime_error(SRC_SHORTAGE);
+
+				*dst++ = *in++;
+				continue;
+			}
+
+			if (inEnd - in < 2)
+				throw std::runtime_error(SRC_SHORTAGE);
+
+			std::size_t length;
+			std::size_t distance;
+
+			if (!lz11)
+			{
+				length = (in[0] >> 4) + 3;
+				distance = ((in[0] & 0xf) << 8 | in[1]) + 1;
+				in += 2;
+			}
+			else if (in[0] >> 4 == 0)
+			{
+				if (inEnd - in < 3)
+					throw std::runtime_error(SRC_SHORTAGE);
+
+				length = ((in[0] & 0xf) << 4 | in[1] >> 4) + 0x11;
+				distance = ((in[1] & 0xf) << 8 | in[2]) + 1;
+				in += 3;
+			}
+			else if (in[0] >> 4 == 1)
+			{
+				if (inEnd - in < 4)
+					throw std::runtime_error(SRC_SHORTAGE);
+
+				length = ((in[0] & 0xf) << 12 | in[1] << 4 | in[2] >> 4) + 0x111;
+				distance = ((in[2] & 0xf) << 8 | in[3]) + 1;
+				in += 4;
+			}
+			else
+			{
+				length = (in[0] >> 4) + 1;
+				distance = ((in[0] & 0xf) << 8 | in[1]) + 1;
+				in += 2;
+			}
+
+			if (distance > static_cast<std::size_t>(dst - outBegin))
+				throw std::runtime_error(INVALID_MATCH);
+
+			// Like the BIOS, stop once the uncompressed size is reached
+			length = std::min<std::size_t>(length, outEnd - dst);
+
+			copyMatch(dst, distance, length);
+			dst += length;
+		}
+	}
+
+	return in - data.data();
+}
+
+static std::size_t uncompressRLE(std::span<const u8> data, std::size_t headerSize, std::span<u8> out)
+{
+	const u8* in = data.data() + headerSize;
+	const u8* const inEnd = data.data() + data.size();
+
+	u8* dst = out.data();
+	u8* const outEnd = dst + out.size();
+
+	while (dst < outEnd)
+	{
+		if (in == inEnd)
+			throw std::runtime_error(SRC_SHORTAGE);
+
+		const u8 flag = *in++;
+
+		if (flag & 0x80)
+		{
+			if (in == inEnd)
+				throw std::runtime_error(SRC_SHORTAGE);
+
+			const std::size_t length = std::min<std::size_t>((flag & 0x7f) + 3, outEnd - dst);
+
+			std::memset(dst, *in++, length);
+			dst += length;
+		}
+		else
+		{
+			const std::size_t length = std::min<std::size_t>((flag & 0x7f) + 1, outEnd - dst);
+
+			if (static_cast<std::size_t>(inEnd - in) < length)
+				throw std::runtime_error(SRC_SHORTAGE);
+
+			std::memcpy(dst, in, length);
+			dst += length;
+			in += length;
+		}
+	}
+
+	return in - data.data();
+}
+
+/**
+ * @brief Uncompress Huffman coded data.
+ * 
+ * The tree follows the header, starting with its size in halfwords minus one.
+ * Each node holds the offset of its pair of children in the low 6 bits, and
+ * bits 7 and 6 tell whether the first and second child are leaves. The codes
+ * are read from 32-bit words, starting at the highest bit.
+ */
+static std::size_t uncompressHuffman(std::span<const u8> data, std::size_t headerSize, std::span<u8> out)
+{
+	const unsigned unitBits = data[0] & 0xf;
+
+	if (data.size() < headerSize + 2)
+		throw std::runtime_error(SRC_SHORTAGE);
+
+	const std::size_t rootPos = headerSize + 1;
+	const std::size_t streamPos = headerSize + (data[headerSize] + 1) * 2;
+
+	if (data.size() < streamPos)
+		throw std::runtime_error(SRC_SHORTAGE);
+
+	const u8* in = data.data() + streamPos;
+	const u8* const inEnd = data.data() + data.size();
+
+	u8* dst = out.data();
+	u8* const outEnd = dst + out.size();
+
+	std::size_t nodePos = rootPos;
+	u8 pending = 0;
+	unsigned pendingBits = 0;
+
+	while (dst < outEnd)
+	{
+		if (inEnd - in < 4)
+			throw std::runtime_error(SRC_SHORTAGE);
+
+		const u32 word = readU32(in);
+		in += 4;
+
+		for (int bit = 31; bit >= 0 && dst < outEnd; --bit)
+		{
+			const unsigned direction = word >> bit & 1;
+			const u8 node = data[nodePos];
+			const std::size_t childPos = (nodePos & ~std::size_t(1)) + (node & 0x3f) * 2 + 2 + direction;
+
+			if (childPos >= streamPos)
+				throw std::runtime_error("Invalid Huffman tree.");
+
+			if (!(node & (0x80 >> direction)))
+			{
+				nodePos = childPos;
+				continue;
+			}
+
+			// The units fill each byte from the lowest bits
+			pending |= (data[childPos] & ((1 << unitBits) - 1)) << pendingBits;
+			pendingBits += unitBits;
+			nodePos = rootPos;
+
+			if (pendingBits >= 8)
+			{
+				*dst++ = pending;
+				pending = 0;
+				pendingBits = 0;
+			}
+		}
+	}
+
+	return in - data.data();
+}
+
+/**
+ * @brief Forward LZ77 match finder over a 4 KiB window.
+ * 
+ * Positions whose next three bytes hash to the same value are chained
+ * together, closest first.
+ */
+class LZMatchFinder
+{
+	static constexpr int hashBits = 15;
+	static constexpr std::size_t window = 0x1000;
+	static constexpr unsigned maxDepth = 256;
+	static constexpr s32 none = -1;
+
+	const u8* src;
+	std::size_t size;
+	std::size_t inserted = 0;
+	std::vector<s32> head;
+	std::vector<s32> prev; // indexed by position % window
+
+	static u32 hash(const u8* p)
+	{
+		return (p[0] | p[1] << 8 | p[2] << 16) * 0x9e3779b1u >> (32 - hashBits);
+	}
+
+public:
+	LZMatchFinder(const u8* src, std::size_t size):
+		src(src),
+		size(size),
+		head(1 << hashBits, none),
+		prev(window, none)
+	{}
+
+	/**
+	 * @brief Find the longest match for the bytes at pos.
+	 * 
+	 * @param pos The position, which must not be lower than in the previous call.
+	 * @param maxLength The maximum length of the match.
+	 * @param minDistance The minimum distance of the match.
+	 * @param distance Receives the distance of the match.
+	 * 
+	 * @return The length of the match, or 0 if there is no match of at least 3 bytes.
+	 */
+	std::size_t find(std::size_t pos, std::size_t maxLength, std::size_t minDistance, std::size_t& distance)
+	{
+		for (; inserted < pos && inserted + 3 <= size; ++inserted)
+		{
+			const u32 h = hash(&src[inserted]);
+			prev[inserted % window] = head[h];
+			head[h] = inserted;
+		}
+
+		maxLength = std::min(maxLength, size - pos);
+
+		if (maxLength < 3)
+			return 0;
+
+		std::size_t bestLength = 0;
+		unsigned depth = 0;
+
+		for (s32 candidate = head[hash(&src[pos])];
+			candidate != none && pos - candidate <= window && depth < maxDepth;
+			++depth)
+		{
+			const std::size_t candidateDistance = pos - candidate;
+
+			if (candidateDistance >= minDistance && src[candidate + bestLength] == src[pos + bestLength])
+			{
+				std::size_t length = 0;
+
+				while (length < maxLength && src[candidate + length] == src[pos + length])
+					++length;
+
+				if (bestLength < length)
+				{
+					bestLength = length;
+					distance = candidateDistance;
+
+					if (length == maxLength)
+						break;
+				}
+			}
+
+			// Stop at entries that were overwritten by a more recent position
+			const s32 next = prev[candidate % window];
+
+			if (next >= candidate)
+				break;
+
+			candidate = next;
+		}
+
+		return bestLength >= 3 ? bestLength : 0;
+	}
+};
+
+static std::vector<u8> compressLZ(std::span<const u8> data, bool lz11)
+{
+	const std::size_t maxLength = lz11 ? 0x10110 : 0x12;
+	const std::size_t minDistance = lz11 ? 1 : 2;
+
+	std::vector<u8> out;
+	out.reserve(8 + data.size() + data.size() / 8 + 4);
+	writeHeader(out, lz11 ? 0x11 : 0x10, data.size());
+
+	LZMatchFinder finder(data.data(), data.size());
+	std::size_t flagPos = 0;
+	int tokenCount = 8;
+
+	for (std::size_t pos = 0; pos < data.size();)
+	{
+		if (tokenCount == 8)
+		{
+			flagPos = out.size();
+			out.push_back(0);
+			tokenCount = 0;
+		}
+
+		std::size_t distance = 0;
+		const std::size_t length = finder.find(pos, maxLength, minDistance, distance);
+
+		if (length == 0)
+			out.push_back(data[pos++]);
+		else
+		{
+			const std::size_t d = distance - 1;
+			out[flagPos] |= 0x80 >> tokenCount;
+
+			if (!lz11)
+				out.insert(out.end(), {static_cast<u8>((length - 3) << 4 | d >> 8), static_cast<u8>(d)});
+			else if (length <= 0x10)
+				out.insert(out.end(), {static_cast<u8>((length - 1) << 4 | d >> 8), static_cast<u8>(d)});
+			else if (length <= 0x110)
+			{
+				const std::size_t l = length - 0x11;
+				out.insert(out.end(), {static_cast<u8>(l >> 4), static_cast<u8>(l << 4 | d >> 8), static_cast<u8>(d)});
+			}
+			else
+			{
+				const std::size_t l = length - 0x111;
+				out.insert(out.end(), {
+					static_cast<u8>(0x10 | l >> 12),
+					static_cast<u8>(l >> 4),
+					static_cast<u8>(l << 4 | d >> 8),
+					static_cast<u8>(d)
+				});
+			}
+
+			pos += length;
+		}
+
+		++tokenCount;
+	}
+
+	out.resize((out.size() + 3) & ~std::size_t(3), 0);
+
+	return out;
+}
+
+namespace Codec
+{
+	const char* formatName(Format format)
+	{
+		return formatNames[static_cast<int>(format)];
+	}
+
+	bool parseFormat(std::string_view name, Format& format)
+	{
+		for (int i = 0; i < static_cast<int>(std::size(formatNames)); ++i)
+		{
+			if (name == formatNames[i])
+			{
+				format = static_cast<Format>(i);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	Format detect(std::span<const u8> data)
+	{
+		if (data.size() < 4 || (readU32(data.data()) >> 8 == 0 && data.size() < 8))
+			return Format::none;
+
+		return formatFromType(data[0]);
+	}
+
+	Format validate(std::span<const u8> data, std::size_t maxSize)
+	{
+		if (detect(data) == Format::none)
+			return Format::none;
+
+		const Header header = readHeader(data);
+
+		if (header.size > maxSize)
+			return Format::none;
+
+		std::vector<u8> out(header.size);
+		std::size_t end;
+
+		try
+		{
+			switch (header.format)
+			{
+			case Format::lz10:    end = uncompressLZ(data, header.headerSize, out, false); break;
+			case Format::lz11:    end = uncompressLZ(data, header.headerSize, out, true);  break;
+			case Format::huffman: end = uncompressHuffman(data, header.headerSize, out);   break;
+			case Format::rle:     end = uncompressRLE(data, header.headerSize, out);       break;
+			default:              return Format::none;
+			}
+		}
+		catch (const std::runtime_error&)
+		{
+			return Format::none;
+		}
+
+		return data.size() - end < 4 ? header.format : Format::none;
+	}
+
+	std::size_t uncompressedSize(std::span<const u8> data)
+	{
+		const Header header = readHeader(data);
+
+		if (header.format == Format::none)
+			throw std::runtime_error("unknown compression format");
+
+		return header.size;
+	}
+
+	std::vector<u8> uncompress(std::span<const u8> data)
+	{
+		const Header header = readHeader(data);
+		std::vector<u8> out(header.size);
+
+		switch (header.format)
+		{
+		case Format::lz10:    uncompressLZ(data, header.headerSize, out, false); break;
+		case Format::lz11:    uncompressLZ(data, header.headerSize, out, true);  break;
+		case Format::huffman: uncompressHuffman(data, header.headerSize, out);   break;
+		case Format::rle:     uncompressRLE(data, header.headerSize, out);       break;
+		case Format::none:
+		case Format::blz:     throw std::runtime_error("unknown compression format");
+		}
+
+		return out;
+	}
+
+	std::vector<u8> compress(std::span<const u8> data, Format format)
+	{
+		switch (format)
+		{
+		case Format::lz10: return compressLZ(data, false);
+		case Format::lz11: return compressLZ(data, true);
+		case Format::blz:
+		{
+			BLZ::Scratch scratch;
+			std::vector<u8> out(BLZ::compressBound(data.size()));
+			out.resize(BLZ::compress(data, out, scratch));
+
+			return out;
+		}
+		default:
+			throw std::invalid_argument(std::string("compression to ") + formatName(format) + " not supported");
+		}
+	}
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.h"
+
+#include <span>
+#include <string_view>
+
+/**
+ * @brief The compression formats of the GBA/DS BIOS, which most NitroFS files use.
+ * 
+ * Every compressed file starts with a 32-bit header: the format in the low byte
+ * and the uncompressed size in the upper 24 bits. If that size is 0, the actual
+ * size follows in the next 32 bits.
+ */
+namespace Codec
+{
+	enum class Format : u8
+	{
+		none,
+		lz10,    ///< LZ77 with up to 18 bytes per match. Decompressible by the BIOS.
+		lz11,    ///< LZ77 with up to 0x10110 bytes per match.
+		huffman, ///< Huffman coding of 4 or 8-bit units.
+		rle,     ///< Run-length encoding.
+		blz      ///< BLZ, see blz.hpp. It has a footer instead of the header, so it is never detected.
+	};
+
+	/**
+	 * @brief The version of the output of Codec::compress, which is part of the cache key.
+	 * It has to be bumped whenever the same input may be compressed differently.
+	 */
+	inline constexpr unsigned version = 1;
+
+	/**
+	 * @brief Get the name of a format as used in the config file.
+	 */
+	const char* formatName(Format format);
+
+	/**
+	 * @brief Get a format by its name.
+	 * 
+	 * @param name The name of the format.
+	 * @param format Receives the format if the name is valid.
+	 * 
+	 * @return Whether the name is valid.
+	 */
+	bool parseFormat(std::string_view name, Format& format);
+
+	/**
+	 * @brief Get the format of compressed data from its header.
+	 * 
+	 * This only looks at the header, so data that isn't compressed
+	 * can still appear to be.
+	 * 
+	 * @return The format, or Format::none if the header isn't valid.
+	 */
+	Format detect(std::span<const u8> data);
+
+	/**
+	 * @brief Check that data is valid compressed data in the format given by its header.
+	 * 
+	 * Unlike detect, this decompresses the data, and the compressed stream has to end at
+	 * the end of the data, give or take the padding to a multiple of 4 bytes.
+	 * 
+	 * @param data The data to check.
+	 * @param maxSize The largest uncompressed size that is considered valid.
+	 * 
+	 * @return The format, or Format::none if the data isn't valid.
+	 */
+	Format validate(std::span<const u8> data, std::size_t maxSize);
+
+	/**
+	 * @brief Get the size of compressed data after uncompressing it.
+	 * 
+	 * @throw std::runtime_error if the header isn't valid.
+	 */
+	std::size_t uncompressedSize(std::span<const u8> data);
+
+	/**
+	 * @brief Uncompress data in any of the formats, as given by its header.
+	 * 
+	 * @param data The data to uncompress.
+	 * 
+	 * @return The decompressed data.
+	 * @throw std::runtime_error if the data is invalid.
+	 */
+	std::vector<u8> uncompress(std::span<const u8> data);
+
+	/**
+	 * @brief Compress data.
+	 * 
+	 * Matches are never closer than 2 bytes in LZ10, so that the data can be
+	 * decompressed into VRAM, which can only be written 16 bits at a time.
+	 * The output is padded to a multiple of 4 bytes.
+	 * 
+	 * @param data The data to compress.
+	 * @param format The format, either lz10, lz11 or blz. BLZ uses the default level and padding.
+	 * 
+	 * @return The compressed data.
+	 * @throw std::invalid_argument if the format isn't supported.
+	 */
+	std::vector<u8> compress(std::span<const u8> data, Format format);
+}
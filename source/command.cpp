@@ -62,19 +62,32 @@ int runCommand(std::string_view commandName, int argc, char** argv)
 constexpr const Command commands[] =
 {
 	{
-		Commands::init, "init", "<clean ROM>", 1,
+		Commands::init, "init", "[--mapped] <clean ROM>", 1,
 		"Initializes a new neondst project in the current directory. "
 		"Files from the  clean  ROM are   extracted to  clean/raw and "
-		"other   relevant directories  are created."
+		"other   relevant directories  are created. "
+		"With --mapped, the ROM is copied to clean/rom.nds instead of "
+		"being extracted, and its files are read straight from the copy "
+		"whenever clean/raw would be used."
 	},
 	{
-		Commands::build, "build", "[<output ROM>]", 0,
+		Commands::build, "build", "[-j <N>] [-n] [-i] [-r] [<output ROM>]", 0,
 		"Builds the ROM from the files in the source directories, "
 		"which are prioritized in this order:"
 		"\n\xa0\xa0\xa0\xa0" "1.\xa0" "modified/final"
 		"\n\xa0\xa0\xa0\xa0" "2.\xa0" "modified/to-be-compressed"
 		"\n\xa0\xa0\xa0\xa0" "3.\xa0" "modified/base"
-		"\n\xa0\xa0\xa0\xa0" "4.\xa0" "clean/raw"
+		"\n\xa0\xa0\xa0\xa0" "4.\xa0" "layers\xa0" "from\xa0.neondst"
+		"\n\xa0\xa0\xa0\xa0" "5.\xa0" "clean/raw\xa0" "(or\xa0" "clean/rom.nds)"
+		"\nFiles in modified/to-be-compressed are compressed using up to N "
+		"threads (-j\xa0<N> or --jobs\xa0<N>, by default the number of CPU cores). "
+		"With -n or --dry-run, nothing is compressed or written; instead, the "
+		"offset, size and source of everything in the ROM are printed. "
+		"With -i or --incremental, the ROM written by the last build is "
+		"patched in place if every file still fits where it was placed; "
+		"only the files that changed are written. "
+		"With -r or --release, the growth slack from .neondst is left out, "
+		"so the ROM is packed tightly."
 	},
 	{
 		Commands::apply, "apply", "[<input ROM>]", 0,
@@ -91,11 +104,27 @@ constexpr const Command commands[] =
 		"build' or 'neondst\xa0" "apply'."
 	},
 	{
-		Commands::decompress, "decompress", "<files...>", 1,
+		Commands::decompress, "decompress", "[-j <N>] (--all [<ROM>] | <files...>)", 1,
 		"Decompresses files from clean/raw to clean/decompressed. "
 		"File paths should be relative to clean/raw. "
-		"At the moment, this is only supported for overlays and the "
-		"ARM9 binary (arm9.bin)."
+		"This is supported for overlays, the ARM9 binary (arm9.bin) and "
+		"files in root compressed with LZ10, LZ11, Huffman or RLE. "
+		"With --all, every compressed overlay and the ARM9 binary are "
+		"found and decompressed, either from clean/raw or directly from "
+		"the given ROM. Files that are already up to date are skipped. "
+		"Up to N files are decompressed at once "
+		"(-j\xa0<N> or --jobs\xa0<N>, by default the number of CPU cores)."
+	},
+	{
+		Commands::index, "index", "[-j <N>] [-o <index file>] [<ROM>]", 0,
+		"Writes an index of the compression format and uncompressed size "
+		"of every overlay and NitroFS file in the ROM, one file per line. "
+		"Headers are only trusted if the whole file decompresses, so "
+		"uncompressed files that happen to start like compressed ones are "
+		"listed as 'none'. The index is written next to the ROM with the "
+		"extension .index unless another path is given (-o\xa0<index\xa0" "file>). "
+		"Up to N files are checked at once "
+		"(-j\xa0<N> or --jobs\xa0<N>, by default the number of CPU cores)."
 	},
 	{
 		Commands::help, "help", "[<command>]", 0,
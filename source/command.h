@@ -92,15 +92,16 @@ struct Command
 
 namespace Commands
 {
-	void init(const fs::path& cleanRomPath);
-	void build(const fs::path& outputPath);
+	void init(std::span<const std::string_view> args);
+	void build(std::span<const std::string_view> args);
 	void apply(const fs::path& romPath);
 	void status(const fs::path& romPath);
-	void decompress(std::span<const fs::path> relativePaths);
+	void decompress(std::span<const std::string_view> args);
+	void index(std::span<const std::string_view> args);
 	void help(std::string_view command = "");
 	void version();
 }
 
-extern const Command commands[7];
+extern const Command commands[8];
 
 int runCommand(std::string_view commandName, int argc, char** argv);
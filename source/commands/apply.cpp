@@ -1,5 +1,6 @@
 #include "command.h"
 #include "config.h"
+#include "mapped.h"
 
 #include <iostream>
 #include <fstream>
@@ -30,12 +31,24 @@ bool fileEquals(const fs::path& path, const void* data, std::size_t size)
 struct ApplyExtractor : Extractor
 {
 	fs::path tempPath;
+	const MappedRom* cleanRom; // used instead of clean/raw in a project created with `init --mapped`
 
-	ApplyExtractor(const fs::path& romPath, const fs::path& tempPath):
+	ApplyExtractor(const fs::path& romPath, const fs::path& tempPath, const MappedRom* cleanRom):
 		Extractor(romPath),
-		tempPath(tempPath)
+		tempPath(tempPath),
+		cleanRom(cleanRom)
 	{}
 
+	bool cleanFileEquals(const fs::path& path, const void* data, std::size_t size) const
+	{
+		if (!cleanRom)
+			return fileExistsAndEquals("clean" / ("raw" / path), data, size);
+
+		const std::span<const u8>* cleanFile = cleanRom->find(path);
+
+		return cleanFile && cleanFile->size() == size && std::memcmp(cleanFile->data(), data, size) == 0;
+	}
+
 	virtual void writeFile(const fs::path& path, const void* data, std::size_t size) override
 	{
 		const fs::path toBeCompressedPath = "modified" / ("to-be-compressed" / path);
@@ -44,12 +57,11 @@ struct ApplyExtractor : Extractor
 		const bool toBeCompressedExists = fs::is_regular_file(toBeCompressedPath);
 		const bool finalExists          = fs::is_regular_file(finalPath);
 
-		const fs::path cleanRawPath = "clean" / ("raw" / path);
 		const fs::path cleanDecompressedPath = "clean" / ("decompressed" / path);
 
 		if (!toBeCompressedExists && !finalExists)
 		{
-			if (fileExistsAndEquals(cleanRawPath, data, size) || fileExistsAndEquals(cleanDecompressedPath, data, size))
+			if (cleanFileEquals(path, data, size) || fileExistsAndEquals(cleanDecompressedPath, data, size))
 				return;
 
 			const fs::path tempFilePath = tempPath / path;
@@ -151,7 +163,8 @@ void Commands::apply(const fs::path& romPath)
 
 	try
 	{
-		ApplyExtractor{config.romPath, tempPath}.extract();
+		const std::unique_ptr<MappedRom> cleanRom = MappedRom::open();
+		ApplyExtractor{config.romPath, tempPath, cleanRom.get()}.extract();
 	}
 	catch (const std::exception& ex)
 	{
@@ -1,9 +1,42 @@
 #include "command.h"
-#include <iostream>
+#include "pack.h"
+#include "parallel.h"
 
-int pack(const fs::path& outputPath);
-
-void Commands::build(const fs::path& outputPath)
+void Commands::build(std::span<const std::string_view> args)
 {
-	pack(outputPath);
+	BuildOptions options;
+	options.jobs = defaultJobCount();
+
+	fs::path outputPath;
+	bool outputPathGiven = false;
+
+	for (std::size_t i = 0; i < args.size(); ++i)
+	{
+		const std::string_view arg = args[i];
+
+		if (arg == "-j" || arg == "--jobs")
+		{
+			if (++i == args.size())
+				throw std::invalid_argument("missing value for " + std::string(arg));
+
+			options.jobs = parseJobCount(args[i]);
+		}
+		else if (arg == "-n" || arg == "--dry-run")
+			options.dryRun = true;
+		else if (arg == "-i" || arg == "--incremental")
+			options.incremental = true;
+		else if (arg == "-r" || arg == "--release")
+			options.release = true;
+		else if (arg.starts_with('-'))
+			throw std::invalid_argument("unknown option: " + std::string(arg));
+		else if (!outputPathGiven)
+		{
+			outputPath = arg;
+			outputPathGiven = true;
+		}
+		else
+			throw std::invalid_argument("too many positional arguments");
+	}
+
+	pack(outputPath, options);
 }
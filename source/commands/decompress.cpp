@@ -1,74 +1,351 @@
 #include "common.h"
 #include "command.h"
 #include "blz.hpp"
+#include "codec.h"
+#include "mapped.h"
+#include "parallel.h"
 #include <iostream>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <array>
+#include <string>
+#include <tuple>
 
 static const fs::path rawPath = fs::path{"clean"} / "raw";
 static const fs::path decompressedPath = fs::path{"clean"} / "decompressed";
 static const fs::path arm9Path = rawPath / "arm9.bin";
 
-void Commands::decompress(std::span<const fs::path> relativePaths)
+struct DecompressJob
 {
-	for (auto& relativePath : relativePaths)
+	fs::path relativePath; // relative to clean/raw and clean/decompressed
+	fs::path inputPath;    // either a file in clean/raw or a ROM
+	u32 offset;
+	u32 size;
+	bool fromRom;
+};
+
+static std::vector<u8> readRange(const fs::path& path, u32 offset, u32 size)
+{
+	std::ifstream inputFile(path, std::ios::in | std::ios::binary);
+
+	if (!inputFile.is_open())
+		throw std::runtime_error("failed to open file " + path.string());
+
+	std::vector<u8> buffer;
+	buffer.reserve(size << 1);
+	buffer.resize(size);
+
+	if (!inputFile.seekg(offset) || !inputFile.read(reinterpret_cast<char*>(buffer.data()), size))
+		throw std::runtime_error("failed to read file " + path.string());
+
+	return buffer;
+}
+
+static bool isNitroFSFile(const fs::path& relativePath)
+{
+	return *relativePath.begin() == "root";
+}
+
+/**
+ * @brief Get the RAM address that arm9.bin is loaded to from the header of the ROM it belongs to.
+ */
+static u32 arm9LoadAddress(const DecompressJob& job)
+{
+	const fs::path headerPath = job.fromRom ? job.inputPath : rawPath / "header.bin";
+
+	return readU32(readRange(headerPath, 0x28, 4).data());
+}
+
+static void decompressFile(const DecompressJob& job, std::vector<u8>& buffer)
+{
+	const fs::path& relativePath = job.relativePath;
+
+	if (isNitroFSFile(relativePath))
+	{
+		if (Codec::detect(buffer) == Codec::Format::none)
+			throw std::runtime_error("unknown compression format");
+
+		buffer = Codec::uncompress(buffer);
+	}
+	else if (relativePath == "arm9.bin")
+	{
+		if (buffer.size() < arm9CompressedEndOffset + 4)
+			throw std::runtime_error("invalid arm9.bin");
+
+		const u32 compressedPartEnd = readU32(buffer.data() + arm9CompressedEndOffset);
+
+		if (buffer.size() != compressedPartEnd - arm9LoadAddress(job))
+			throw std::runtime_error("invalid arm9.bin");
+
+		BLZ::uncompressInplace(buffer);
+		std::memset(buffer.data() + arm9CompressedEndOffset, 0, 4);
+	}
+	else
+		BLZ::uncompressInplace(buffer);
+}
+
+static void writeOutputFile(const fs::path& outputPath, const std::vector<u8>& buffer)
+{
+	fs::create_directories(outputPath.parent_path());
+	std::ofstream outputFile(outputPath, std::ios::binary | std::ios::out);
+
+	if (!outputFile.is_open())
+		throw std::runtime_error("failed to create file " + outputPath.string());
+
+	if (!outputFile.write(reinterpret_cast<const char*>(buffer.data()), buffer.size()))
+		throw std::runtime_error("failed to write file " + outputPath.string());
+}
+
+static bool isArm9Compressed(const fs::path& path, u32 offset, u32 size)
+{
+	if (size < arm9CompressedEndOffset + 4)
+		return false;
+
+	return readU32(readRange(path, offset + arm9CompressedEndOffset, 4).data()) != 0;
+}
+
+/**
+ * @brief Add a job for every overlay that is marked as compressed in an overlay table.
+ *
+ * @param getLocation Called with the relative path and file ID of each compressed
+ * overlay, returns the input path and the offset and size of the overlay in it.
+ */
+template<class GetLocation>
+static void findCompressedOverlays(
+	std::vector<DecompressJob>& jobs,
+	const std::vector<u8>& ovt,
+	const fs::path& dir,
+	bool fromRom,
+	GetLocation&& getLocation
+)
+{
+	for (u32 i = 0; i < ovt.size() / 32; i++)
+	{
+		const u8* entry = &ovt[i * 32];
+
+		if (!(entry[0x1f] & 1)) // compressed flag
+			continue;
+
+		const fs::path relativePath = dir / (std::to_string(readU32(entry)) + ".bin");
+		const auto [inputPath, offset, size] = getLocation(relativePath, readU16(entry + 0x18));
+
+		jobs.push_back({relativePath, inputPath, offset, size, fromRom});
+	}
+}
+
+static std::vector<DecompressJob> findCompressedFilesInRom(const fs::path& romPath)
+{
+	const std::vector<u8> header = readRange(romPath, 0, 0x200);
+
+	const u32 arm9Offset = readU32(&header[0x20]);
+	const u32 arm9Size   = readU32(&header[0x2c]);
+	const u32 fatOffset  = readU32(&header[0x48]);
+	const u32 fatSize    = readU32(&header[0x4c]);
+	const u32 ovt9Offset = readU32(&header[0x50]);
+	const u32 ovt9Size   = readU32(&header[0x54]);
+	const u32 ovt7Offset = readU32(&header[0x58]);
+	const u32 ovt7Size   = readU32(&header[0x5c]);
+
+	const std::vector<u8> fat = readRange(romPath, fatOffset, fatSize);
+	std::vector<DecompressJob> jobs;
+
+	if (isArm9Compressed(romPath, arm9Offset, arm9Size))
+		jobs.push_back({"arm9.bin", romPath, arm9Offset, arm9Size, true});
+
+	auto getLocation = [&](const fs::path& relativePath, u16 fileID)
+	{
+		if (fileID * 8u + 8 > fat.size())
+			throw std::runtime_error("invalid file ID of " + relativePath.string());
+
+		const u32 start = readU32(&fat[fileID * 8]);
+		const u32 end   = readU32(&fat[fileID * 8 + 4]);
+
+		return std::tuple(romPath, start, end - start);
+	};
+
+	findCompressedOverlays(jobs, readRange(romPath, ovt9Offset, ovt9Size), "overlay9", true, getLocation);
+	findCompressedOverlays(jobs, readRange(romPath, ovt7Offset, ovt7Size), "overlay7", true, getLocation);
+
+	return jobs;
+}
+
+static std::vector<DecompressJob> findCompressedFilesInRaw()
+{
+	std::vector<DecompressJob> jobs;
+
+	if (const u32 arm9Size = fs::file_size(arm9Path); isArm9Compressed(arm9Path, 0, arm9Size))
+		jobs.push_back({"arm9.bin", arm9Path, 0, arm9Size, false});
+
+	auto getLocation = [](const fs::path& relativePath, u16)
 	{
 		const fs::path inputPath = rawPath / relativePath;
-		const fs::path outputPath = decompressedPath / relativePath;
-		const fs::path parentPath = inputPath.parent_path();
-		const bool isArm9Bin = fs::equivalent(inputPath, arm9Path);
 
-		if (!isArm9Bin && fs::equivalent(parentPath, rawPath))
+		return std::tuple(inputPath, 0u, static_cast<u32>(fs::file_size(inputPath)));
+	};
+
+	for (const char* prefix : {"9", "7"})
+	{
+		const fs::path ovtPath = rawPath / ("arm" + std::string(prefix) + "ovt.bin");
+		const std::vector<u8> ovt = readRange(ovtPath, 0, fs::file_size(ovtPath));
+
+		findCompressedOverlays(jobs, ovt, "overlay" + std::string(prefix), false, getLocation);
+	}
+
+	return jobs;
+}
+
+/**
+ * @param cleanRom If given, the files are read from the mapped clean ROM instead of clean/raw.
+ */
+static std::vector<DecompressJob> getJobsForPaths(std::span<const std::string_view> relativePaths, const MappedRom* cleanRom)
+{
+	std::vector<DecompressJob> jobs;
+
+	for (const std::string_view arg : relativePaths)
+	{
+		const fs::path relativePath = fs::path(arg).lexically_normal();
+		const fs::path inputPath = rawPath / relativePath;
+		const fs::path parentPath = relativePath.parent_path();
+		const bool isArm9Bin = relativePath == "arm9.bin";
+
+		if (!isArm9Bin && parentPath.empty())
 		{
 			std::cout << WARNING << inputPath << " should not be compressed (skipped)\n";
 			continue;
 		}
 
-		std::cout << "Decompressing " << inputPath;
-		std::cout << " -> " << outputPath << '\n';
+		if (!isArm9Bin
+			&& !isNitroFSFile(relativePath)
+			&& parentPath != "overlay9"
+			&& parentPath != "overlay7")
+		{
+			throw std::runtime_error("only overlays, arm9.bin and files in root can be decompressed: " + inputPath.string());
+		}
 
-		std::ifstream inputFile(inputPath, std::ios::in | std::ios::binary);
+		if (!cleanRom)
+		{
+			const u32 size = fs::file_size(inputPath);
+			jobs.push_back({relativePath, inputPath, 0, size, false});
+			continue;
+		}
 
-		if (!inputFile.is_open())
-			throw std::runtime_error("failed to open file " + inputPath.string());
+		const std::span<const u8>* file = cleanRom->find(relativePath);
 
-		auto compressedSize = fs::file_size(inputPath);
-		std::vector<u8> buffer;
-		buffer.reserve(compressedSize << 1);
-		buffer.resize(compressedSize);
+		if (!file)
+			throw std::runtime_error("could not find file " + relativePath.string() + " in " + mappedCleanRomPath.string());
 
-		if (!inputFile.read(reinterpret_cast<char*>(buffer.data()), compressedSize))
-			throw std::runtime_error("failed to read file " + inputPath.string());
+		const u32 offset = file->data() - cleanRom->data().data();
+		jobs.push_back({relativePath, mappedCleanRomPath, offset, static_cast<u32>(file->size()), true});
+	}
 
-		if (isArm9Bin)
-		{
-			if (compressedSize < 0xaf0)
-				throw std::runtime_error("invalid arm9.bin");
+	return jobs;
+}
 
-			const u32 compressedPartEnd = readU32(buffer.data() + 0xaec);
+static bool isUpToDate(const DecompressJob& job)
+{
+	const fs::path outputPath = decompressedPath / job.relativePath;
+
+	return fs::is_regular_file(outputPath)
+		&& fs::last_write_time(job.inputPath) <= fs::last_write_time(outputPath);
+}
 
-			if (compressedSize != compressedPartEnd - 0x02004000)
-				throw std::runtime_error("invalid arm9.bin");
+void Commands::decompress(std::span<const std::string_view> args)
+{
+	unsigned jobCount = defaultJobCount();
+	bool all = false;
+	std::vector<std::string_view> positionalArgs;
 
-			BLZ::uncompressInplace(buffer);
-			std::memset(buffer.data() + 0xaec, 0, 4);
+	for (std::size_t i = 0; i < args.size(); ++i)
+	{
+		const std::string_view arg = args[i];
+
+		if (arg == "-j" || arg == "--jobs")
+		{
+			if (++i == args.size())
+				throw std::invalid_argument("missing value for " + std::string(arg));
+
+			jobCount = parseJobCount(args[i]);
 		}
-		else if (fs::equivalent(parentPath, rawPath / "overlay9"))
-			BLZ::uncompressInplace(buffer);
+		else if (arg == "-a" || arg == "--all")
+			all = true;
+		else if (arg.starts_with('-'))
+			throw std::invalid_argument("unknown option: " + std::string(arg));
+		else
+			positionalArgs.push_back(arg);
+	}
+
+	std::vector<DecompressJob> jobs;
+
+	// A project created with `init --mapped` has the clean ROM instead of clean/raw
+	const std::unique_ptr<MappedRom> cleanRom = MappedRom::open();
+
+	if (all)
+	{
+		if (positionalArgs.size() > 1)
+			throw std::invalid_argument("too many positional arguments");
+
+		if (!positionalArgs.empty())
+			jobs = findCompressedFilesInRom(positionalArgs[0]);
+		else if (cleanRom)
+			jobs = findCompressedFilesInRom(mappedCleanRomPath);
+		else
+			jobs = findCompressedFilesInRaw();
+
+		const std::size_t jobCountBefore = jobs.size();
+		std::erase_if(jobs, isUpToDate);
+
+		if (const std::size_t skipped = jobCountBefore - jobs.size())
+			std::cout << "Skipping " << skipped << " up-to-date file(s)\n";
+	}
+	else if (positionalArgs.empty())
+		throw std::invalid_argument("no files given");
+	else
+		jobs = getJobsForPaths(positionalArgs, cleanRom.get());
+
+	for (const DecompressJob& job : jobs)
+	{
+		std::cout << "Decompressing ";
+
+		if (job.fromRom)
+			std::cout << job.relativePath << " from " << job.inputPath;
 		else
-			throw std::runtime_error("decompression of regular files not implemented yet");
+			std::cout << job.inputPath;
+
+		std::cout << " -> " << decompressedPath / job.relativePath << '\n';
+	}
+
+	std::vector<std::string> errors(jobs.size());
 
-		fs::create_directories(outputPath.parent_path());
-		std::ofstream outputFile(outputPath, std::ios::binary | std::ios::out);
+	parallelFor(jobs.size(), jobCount, [&](std::size_t i)
+	{
+		const DecompressJob& job = jobs[i];
+
+		try
+		{
+			std::vector<u8> buffer = readRange(job.inputPath, job.offset, job.size);
+			decompressFile(job, buffer);
+			writeOutputFile(decompressedPath / job.relativePath, buffer);
+		}
+		catch (const std::exception& ex)
+		{
+			errors[i] = job.relativePath.string() + ": " + ex.what();
+		}
+	});
 
-		if (!outputFile.is_open())
-			throw std::runtime_error("failed to create file " + outputPath.string());
+	std::size_t errorCount = 0;
 
-		if (!outputFile.write(reinterpret_cast<const char*>(buffer.data()), buffer.size()))
-			throw std::runtime_error("failed to write file " + outputPath.string());
+	for (const std::string& error : errors)
+	{
+		if (!error.empty())
+		{
+			std::cout << ERROR << error << '\n';
+			errorCount++;
+		}
 	}
 
+	if (errorCount)
+		throw std::runtime_error("failed to decompress " + std::to_string(errorCount) + " file(s)");
+
 	std::cout << "Done\n";
 }
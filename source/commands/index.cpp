@@ -0,0 +1,157 @@
+#include "command.h"
+#include "config.h"
+#include "blz.hpp"
+#include "codec.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+// Larger files wouldn't fit in the RAM of a DS, so such headers are taken as false positives
+static constexpr std::size_t maxUncompressedSize = 0x1000000;
+
+struct IndexEntry
+{
+	u16 fileID;
+	fs::path path;
+	u32 size;
+	Codec::Format format = Codec::Format::none;
+	std::size_t uncompressedSize = 0;
+	std::vector<u8> data; // only kept if it might be compressed
+};
+
+/**
+ * @brief Check the BLZ footer without uncompressing anything.
+ */
+static bool hasBLZFooter(std::span<const u8> data)
+{
+	if (data.size() < 8)
+		return false;
+
+	const u32 offsetIn = readU32(&data[data.size() - 8]);
+	const u32 footerSize = offsetIn >> 24;
+	const u32 compressedSize = offsetIn & 0xffffff;
+
+	return footerSize >= 8 && footerSize <= 11
+		&& compressedSize >= footerSize && compressedSize <= data.size()
+		&& readU32(&data[data.size() - 4]) <= maxUncompressedSize;
+}
+
+static bool mightBeCompressed(std::span<const u8> data)
+{
+	return Codec::detect(data) != Codec::Format::none || hasBLZFooter(data);
+}
+
+struct IndexExtractor : Extractor
+{
+	using Extractor::Extractor;
+	std::vector<IndexEntry> entries;
+
+	virtual void writeFile(const fs::path&, const void*, std::size_t) override {}
+	virtual void writeDir(const fs::path&) override {}
+
+	virtual void writeFatFile(const fs::path& shortPath, u16 fileID, const void* data, std::size_t size) override
+	{
+		IndexEntry& entry = entries.emplace_back(fileID, shortPath, size);
+		const std::span<const u8> bytes = {static_cast<const u8*>(data), size};
+
+		if (mightBeCompressed(bytes))
+			entry.data.assign(bytes.begin(), bytes.end());
+	}
+};
+
+static void classify(IndexEntry& entry)
+{
+	entry.uncompressedSize = entry.size;
+
+	if (entry.data.empty())
+		return;
+
+	if (const Codec::Format format = Codec::validate(entry.data, maxUncompressedSize); format != Codec::Format::none)
+	{
+		entry.format = format;
+		entry.uncompressedSize = Codec::uncompressedSize(entry.data);
+	}
+	else if (hasBLZFooter(entry.data) && BLZ::validate(entry.data))
+	{
+		entry.format = Codec::Format::blz;
+		entry.uncompressedSize = BLZ::uncompressedSize(entry.data);
+	}
+
+	entry.data = {};
+}
+
+void Commands::index(std::span<const std::string_view> args)
+{
+	unsigned jobCount = defaultJobCount();
+	fs::path romPath;
+	fs::path indexPath;
+
+	for (std::size_t i = 0; i < args.size(); ++i)
+	{
+		const std::string_view arg = args[i];
+
+		if (arg == "-j" || arg == "--jobs" || arg == "-o" || arg == "--output")
+		{
+			if (++i == args.size())
+				throw std::invalid_argument("missing value for " + std::string(arg));
+
+			if (arg == "-o" || arg == "--output")
+				indexPath = args[i];
+			else
+				jobCount = parseJobCount(args[i]);
+		}
+		else if (arg.starts_with('-'))
+			throw std::invalid_argument("unknown option: " + std::string(arg));
+		else if (romPath.empty())
+			romPath = arg;
+		else
+			throw std::invalid_argument("too many positional arguments");
+	}
+
+	Config config(romPath);
+
+	if (config.romPath.empty())
+		throw std::invalid_argument("no ROM given");
+
+	if (indexPath.empty())
+		indexPath = fs::path(config.romPath).replace_extension(".index");
+
+	std::cout << "Reading " << config.romPath << '\n';
+
+	IndexExtractor extractor {config.romPath};
+	extractor.extract();
+
+	std::vector<IndexEntry>& entries = extractor.entries;
+
+	parallelFor(entries.size(), jobCount, [&](std::size_t i)
+	{
+		classify(entries[i]);
+	});
+
+	std::ranges::sort(entries, {}, &IndexEntry::fileID);
+
+	std::ofstream indexFile(indexPath, std::ios::out);
+
+	if (!indexFile.is_open())
+		throw std::runtime_error("failed to create file " + indexPath.string());
+
+	indexFile << "# file ID, format, uncompressed size, path\n";
+
+	std::size_t compressedCount = 0;
+
+	for (const IndexEntry& entry : entries)
+	{
+		indexFile << entry.fileID << '\t' << Codec::formatName(entry.format) << '\t'
+			<< entry.uncompressedSize << '\t' << entry.path.generic_string() << '\n';
+
+		compressedCount += entry.format != Codec::Format::none;
+	}
+
+	if (!indexFile)
+		throw std::runtime_error("failed to write file " + indexPath.string());
+
+	std::cout << "Found " << compressedCount << " compressed file(s) out of " << entries.size()
+		<< ", written to " << indexPath << '\n';
+}
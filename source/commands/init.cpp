@@ -1,5 +1,9 @@
 #include "command.h"
+#include "mapped.h"
+#include "writer.h"
+
 #include <fstream>
+#include <iostream>
 
 static const fs::path cleanRawPath = fs::path("clean") / "raw";
 
@@ -34,14 +38,44 @@ struct InitExtractor : Extractor
 	}
 };
 
-void Commands::init(const fs::path& cleanRomPath)
+void Commands::init(std::span<const std::string_view> args)
 {
+	fs::path cleanRomPath;
+	bool mapped = false;
+
+	for (const std::string_view arg : args)
+	{
+		if (arg == "--mapped")
+			mapped = true;
+		else if (arg.starts_with('-'))
+			throw std::invalid_argument("unknown option: " + std::string(arg));
+		else if (cleanRomPath.empty())
+			cleanRomPath = arg;
+		else
+			throw std::invalid_argument("too many positional arguments");
+	}
+
+	if (cleanRomPath.empty())
+		throw std::invalid_argument("no clean ROM given");
+
 	const fs::path clean = "clean";
 
 	fs::remove_all(clean);
 	fs::create_directory(clean);
 
-	InitExtractor(cleanRomPath).extract();
+	if (mapped)
+	{
+		// Make sure that the ROM can be indexed before it's used as the clean layer
+		const MappedRom cleanRom(cleanRomPath);
+
+		std::cout << "Copying " << cleanRomPath << " to " << mappedCleanRomPath << '\n';
+
+		FileWriter copy(mappedCleanRomPath);
+		copy.copy(0, cleanRomPath, fs::file_size(cleanRomPath));
+		copy.commit();
+	}
+	else
+		InitExtractor(cleanRomPath).extract();
 
 	fs::create_directory(clean / "decompressed");
 
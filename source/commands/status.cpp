@@ -1,5 +1,6 @@
 #include "command.h"
 #include "config.h"
+#include "mapped.h"
 
 #include <unordered_set>
 #include <iostream>
@@ -11,7 +12,20 @@ const fs::path modifiedToBeCompressed = fs::path("modified") / "to-be-compressed
 
 struct StatusExtractor : Extractor
 {
-	using Extractor::Extractor;
+	// modified/base and the layers from the config, from the highest priority to the lowest
+	std::vector<fs::path> editableDirs;
+
+	// Used instead of clean/raw in a project created with `init --mapped`
+	const MappedRom* cleanRom;
+
+	StatusExtractor(const Config& config, const MappedRom* cleanRom):
+		Extractor(config.romPath),
+		editableDirs({modifiedBase}),
+		cleanRom(cleanRom)
+	{
+		editableDirs.insert(editableDirs.end(), config.layers.rbegin(), config.layers.rend());
+	}
+
 	std::unordered_set<fs::path> paths;
 	std::vector<fs::path> diffPaths;
 	std::vector<fs::path> romOnlyPaths;
@@ -23,14 +37,18 @@ struct StatusExtractor : Extractor
 		if (fileExistsAndEquals(modifiedFinal / shortPath, data, size))
 			return;
 
-		fs::path modifiedBasePath = modifiedBase / shortPath;
-
-		if (fs::is_regular_file(modifiedBasePath))
+		for (const fs::path& dir : editableDirs)
 		{
-			if (!fileEquals(modifiedBasePath, data, size))
-				diffPaths.push_back(shortPath);
+			if (const fs::path editablePath = dir / shortPath; fs::is_regular_file(editablePath))
+			{
+				if (!fileEquals(editablePath, data, size))
+					diffPaths.push_back(shortPath);
+
+				return;
+			}
 		}
-		else if (!fs::is_regular_file(cleanRaw / shortPath))
+
+		if (cleanRom ? !cleanRom->find(shortPath) : !fs::is_regular_file(cleanRaw / shortPath))
 			romOnlyPaths.push_back(shortPath);
 	}
 
@@ -39,8 +57,10 @@ struct StatusExtractor : Extractor
 		paths.insert(shortPath);
 
 		if (fs::is_directory(modifiedFinal / shortPath)) return;
-		if (fs::is_directory(modifiedBase / shortPath)) return;
-		if (fs::is_directory(cleanRaw / shortPath)) return;
+		if (cleanRom ? cleanRom->isDirectory(shortPath) : fs::is_directory(cleanRaw / shortPath)) return;
+
+		for (const fs::path& dir : editableDirs)
+			if (fs::is_directory(dir / shortPath)) return;
 
 		romOnlyPaths.push_back(shortPath);
 	}
@@ -50,13 +70,18 @@ void Commands::status(const fs::path& romPath)
 {
 	Config config(romPath);
 
-	StatusExtractor status {config.romPath};
+	const std::unique_ptr<MappedRom> cleanRom = MappedRom::open();
+
+	StatusExtractor status {config, cleanRom.get()};
 	status.extract();
 
 	bool changes = false;
 	std::vector<fs::path> sourceOnlyPaths;
 
-	for (const fs::path& rootPath : {modifiedBase, modifiedToBeCompressed, modifiedFinal})
+	std::vector<fs::path> rootPaths = {modifiedBase, modifiedToBeCompressed, modifiedFinal};
+	rootPaths.insert(rootPaths.end(), config.layers.begin(), config.layers.end());
+
+	for (const fs::path& rootPath : rootPaths)
 	{
 		if (!fs::is_directory(rootPath))
 			continue;
@@ -75,7 +100,7 @@ void Commands::status(const fs::path& romPath)
 	if (!sourceOnlyPaths.empty())
 	{
 		changes = true;
-		std::cout << "Files in " << fs::path("modified") << " not in " << config.romPath << ":\n";
+		std::cout << "Files in the source directories not in " << config.romPath << ":\n";
 
 		for (const fs::path& p : sourceOnlyPaths)
 			std::cout << "\t\x1b[0;32m" << p.string() << "\x1b[0m\n";
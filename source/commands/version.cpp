@@ -14,6 +14,7 @@ const char logo[] = R"(
 )";
 
 constexpr const char versionString[] = NEONDST_VERSION;
+extern const char neondstVersion[] = NEONDST_VERSION;
 
 void Commands::version()
 {
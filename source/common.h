@@ -4,6 +4,7 @@
 #include <string>
 #include <cstdint>
 #include <filesystem>
+#include <span>
 
 #define WARNING "\x1b[1;95mwarning: \x1b[0m"
 #define ERROR   "\x1b[1;91merror: \x1b[0m"
@@ -11,9 +12,11 @@
 using s8 = std::int8_t;
 using s16 = std::int16_t;
 using s32 = std::int32_t;
+using s64 = std::int64_t;
 using u8 = std::uint8_t;
 using u16 = std::uint16_t;
 using u32 = std::uint32_t;
+using u64 = std::uint64_t;
 
 namespace fs = std::filesystem;
 
@@ -23,8 +26,18 @@ struct Extractor
 	Extractor(const fs::path& romPath) : romPath(romPath) {}
 	void extract();
 
+	// Extract from the contents of the ROM, which are already in memory.
+	// Throws std::runtime_error if the header, FAT or FNT point outside of it.
+	void extract(std::span<const u8> rom);
+
 	virtual void writeFile(const fs::path& shortPath, const void* data, std::size_t size) = 0;
 	virtual void writeDir (const fs::path& shortPath) = 0;
+
+	// Called instead of writeFile for the files in the FAT (overlays and NitroFS files)
+	virtual void writeFatFile(const fs::path& shortPath, [[maybe_unused]] u16 fileID, const void* data, std::size_t size)
+	{
+		writeFile(shortPath, data, size);
+	}
 };
 
 struct NDSDirectory
@@ -39,10 +52,20 @@ struct NDSDirectory
 bool fileEquals(const fs::path& path, const void* data, std::size_t size);
 bool fileExistsAndEquals(const fs::path& path, const void* data, std::size_t size);
 
-NDSDirectory buildFntTree(u8* fnt, u32 dirID, u32 fntSize);
+NDSDirectory buildFntTree(const u8* fnt, u32 dirID, u32 fntSize);
 
 constexpr std::size_t oneGB = 1ull << 30;
 
+// The version of neondst, either a tag like "v1.2" or a commit hash
+extern const char neondstVersion[];
+
+// When arm9.bin is compressed, its first arm9UncompressedSize bytes (including
+// the secure area) are stored as is and the module params hold the RAM address
+// of the end of the compressed data, which depends on the load address at 0x28
+// of the header.
+constexpr u32 arm9UncompressedSize    = 0x4000;
+constexpr u32 arm9CompressedEndOffset = 0xaec;
+
 inline u32 readU16(const u8* p)
 {
 	return p[0] | p[1] << 8;
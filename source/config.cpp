@@ -1,7 +1,10 @@
 #include "config.h"
 
+#include <charconv>
 #include <iostream>
 #include <fstream>
+#include <ranges>
+#include <string_view>
 
 static u8 toU8(u32 val, const std::string& name)
 {
@@ -11,6 +14,83 @@ static u8 toU8(u32 val, const std::string& name)
 	throw std::invalid_argument('\'' + name + "' must be a hex value from 0 to ff");
 }
 
+static BLZ::Level toLevel(const std::string& val, const std::string& name)
+{
+	BLZ::Level level;
+
+	// scan is only a reference for testing the other levels
+	if (BLZ::parseLevel(val, level) && level != BLZ::Level::scan)
+		return level;
+
+	throw std::invalid_argument("invalid value for '" + name + "': " + val + " (expected fast, normal or max)");
+}
+
+static Codec::Format toFormat(const std::string& val, const std::string& name)
+{
+	Codec::Format format;
+
+	if (Codec::parseFormat(val, format)
+		&& (format == Codec::Format::lz10 || format == Codec::Format::lz11 || format == Codec::Format::blz))
+	{
+		return format;
+	}
+
+	throw std::invalid_argument("invalid value for '" + name + "': " + val + " (expected lz10, lz11 or blz)");
+}
+
+static bool parseU32(std::string_view text, u32& value, int base)
+{
+	const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+
+	return ec == std::errc() && end == text.data() + text.size();
+}
+
+static bool globMatch(std::string_view pattern, std::string_view path)
+{
+	while (!pattern.empty())
+	{
+		if (pattern.starts_with("**"))
+		{
+			pattern.remove_prefix(2);
+
+			// "**/" also matches no directory at all
+			if (pattern.starts_with('/') && globMatch(pattern.substr(1), path))
+				return true;
+
+			for (std::size_t i = 0; i <= path.size(); ++i)
+				if (globMatch(pattern, path.substr(i)))
+					return true;
+
+			return false;
+		}
+
+		if (pattern[0] == '*')
+		{
+			pattern.remove_prefix(1);
+
+			for (std::size_t i = 0; i <= path.size(); ++i)
+			{
+				if (globMatch(pattern, path.substr(i)))
+					return true;
+
+				if (i < path.size() && path[i] == '/')
+					break;
+			}
+
+			return false;
+		}
+
+		// '?' matches any character but '/'
+		if (path.empty() || (pattern[0] != path[0] && (pattern[0] != '?' || path[0] == '/')))
+			return false;
+
+		pattern.remove_prefix(1);
+		path.remove_prefix(1);
+	}
+
+	return path.empty();
+}
+
 Config::Config(const fs::path& path):
 	romPath(path)
 {
@@ -51,6 +131,74 @@ Config::Config(const fs::path& path):
 			continue;
 		}
 
+		if (first == "cache")
+		{
+			cachePath = sv;
+			continue;
+		}
+
+		if (first == "layer")
+		{
+			if (sv.empty())
+				throw std::invalid_argument("expected 'layer <directory>'");
+
+			layers.push_back(sv);
+			continue;
+		}
+
+		if (first == "compression")
+		{
+			// either "compression <level>" or "compression <file> <level>"
+			std::string pathOrLevel, level;
+			s >> pathOrLevel >> level;
+
+			if (level.empty())
+				compression = toLevel(pathOrLevel, first);
+			else
+				fileCompression[pathOrLevel] = toLevel(level, first);
+
+			continue;
+		}
+
+		if (first == "slack")
+		{
+			// "slack [<percent>%] [align <size>]"
+			std::string token;
+			slackPercent = 0;
+			slackAlign = 0;
+
+			while (s >> token)
+			{
+				std::string value;
+				bool valid = false;
+
+				if (token == "align")
+					valid = s >> value && parseU32(value, slackAlign, 16);
+				else if (token.ends_with('%'))
+					valid = parseU32(std::string_view(token).substr(0, token.size() - 1), slackPercent, 10);
+
+				if (!valid)
+					throw std::invalid_argument("expected 'slack [<percent>%] [align <size>]' (the size is hexadecimal)");
+			}
+
+			if (slackAlign & (slackAlign - 1))
+				throw std::invalid_argument("the alignment of 'slack' must be a power of two");
+
+			continue;
+		}
+
+		if (first == "compress")
+		{
+			std::string pattern, format;
+			s >> pattern >> format;
+
+			if (format.empty())
+				throw std::invalid_argument("expected 'compress <pattern> <format>'");
+
+			compressionRules.push_back({pattern, toFormat(format, first)});
+			continue;
+		}
+
 		u32 val;
 		try
 		{
@@ -95,4 +243,68 @@ void Config::print() const
 	f("ovt_repl_flag: ", ovtReplFlag);
 
 	std::cout << std::dec;
-}
\ No newline at end of file
+	std::cout << "\tcache: " << cachePath << '\n';
+	std::cout << "\tcompression: " << BLZ::levelName(compression) << '\n';
+
+	for (const auto& [path, level] : fileCompression)
+		std::cout << "\tcompression of " << path << ": " << BLZ::levelName(level) << '\n';
+
+	for (const CompressionRule& rule : compressionRules)
+		std::cout << "\tcompress " << rule.pattern << ": " << Codec::formatName(rule.format) << '\n';
+
+	for (const fs::path& layer : layers)
+		std::cout << "\tlayer: " << layer << '\n';
+
+	if (slackPercent || slackAlign)
+		std::cout << "\tslack: " << slackPercent << "% align 0x" << std::hex << slackAlign << std::dec << '\n';
+}
+
+std::string Config::serialize() const
+{
+	std::ostringstream s;
+
+	s << romPath.generic_string() << '\n' << cachePath.generic_string() << '\n' << std::hex
+		<< +ovtReplFlag << ' ' << padding << ' '
+		<< arm9Entry << ' ' << arm9Load << ' ' << arm7Entry << ' ' << arm7Load << ' '
+		<< slackPercent << ' ' << slackAlign << '\n'
+		<< BLZ::levelName(compression) << '\n';
+
+	for (const auto& [path, level] : fileCompression)
+		s << "compression " << path.generic_string() << ' ' << BLZ::levelName(level) << '\n';
+
+	for (const CompressionRule& rule : compressionRules)
+		s << "compress " << rule.pattern << ' ' << Codec::formatName(rule.format) << '\n';
+
+	for (const fs::path& layer : layers)
+		s << "layer " << layer.generic_string() << '\n';
+
+	return s.str();
+}
+
+BLZ::Level Config::compressionLevel(const fs::path& path) const
+{
+	const auto it = fileCompression.find(path);
+
+	return it != fileCompression.end() ? it->second : compression;
+}
+
+u32 Config::growthSlack(u32 size) const
+{
+	u64 reserved = size + (static_cast<u64>(size) * slackPercent + 99) / 100;
+
+	if (slackAlign)
+		reserved = (reserved + slackAlign - 1) & ~static_cast<u64>(slackAlign - 1);
+
+	return std::min<u64>(reserved - size, oneGB);
+}
+
+Codec::Format Config::compressionFormat(const fs::path& path) const
+{
+	const std::string pathString = path.generic_string();
+
+	for (const CompressionRule& rule : compressionRules | std::views::reverse)
+		if (globMatch(rule.pattern, pathString))
+			return rule.format;
+
+	return Codec::Format::none;
+}
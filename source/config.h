@@ -1,6 +1,22 @@
 #pragma once
 
 #include "common.h"
+#include "blz.hpp"
+#include "codec.h"
+
+#include <map>
+
+/**
+ * @brief A `compress <pattern> <format>` rule for files in modified/to-be-compressed/root.
+ * 
+ * In the pattern, `*` matches any part of a file or directory name, `?` matches
+ * any character but '/' and `**` matches any number of directories.
+ */
+struct CompressionRule
+{
+	std::string pattern; ///< relative to modified/to-be-compressed, e.g. root/data/*.bin
+	Codec::Format format;
+};
 
 struct Config
 {
@@ -8,13 +24,44 @@ struct Config
 	static constexpr s16 noPadding = -1;
 
 	fs::path romPath;
+	fs::path cachePath = ".neondst-cache";
 	u8 ovtReplFlag = 0xff;
 	s16 padding = noPadding;
 	u32 arm9Entry = keep;
 	u32 arm9Load  = keep;
 	u32 arm7Entry = keep;
 	u32 arm7Load  = keep;
+	BLZ::Level compression = BLZ::Level::normal;
+	std::map<fs::path, BLZ::Level> fileCompression;
+	std::vector<CompressionRule> compressionRules;
+	std::vector<fs::path> layers; ///< extra source directories between modified/base and clean/raw
+	u32 slackPercent = 0; ///< growth slack after files that are likely to change, in percent of their size
+	u32 slackAlign = 0;   ///< the size of these files including the slack is rounded up to a multiple of this
 
 	Config(const fs::path& path);
 	void print() const;
+
+	/**
+	 * @brief Get all values as text, to detect when any of them changed.
+	 */
+	std::string serialize() const;
+
+	BLZ::Level compressionLevel(const fs::path& path) const;
+
+	/**
+	 * @brief Get the format of the last compression rule that matches a path.
+	 * 
+	 * @param path The path relative to modified/to-be-compressed.
+	 * 
+	 * @return The format, or Codec::Format::none if no rule matches.
+	 */
+	Codec::Format compressionFormat(const fs::path& path) const;
+
+	/**
+	 * @brief Get how much space to leave free after a file that is likely to change,
+	 * so that it can grow without moving the files after it (see `slack` in the README).
+	 * 
+	 * @param size The size of the file.
+	 */
+	u32 growthSlack(u32 size) const;
 };
@@ -1,16 +1,46 @@
 #include <iostream>
 #include <filesystem>
-#include <fstream>
 #include <span>
 
 #include "common.h"
+#include "mapped.h"
+
+/**
+ * @brief Get a part of the ROM, checking that it is inside of the ROM.
+ * 
+ * @param what What the part is, for the error message.
+ */
+static std::span<const u8> romPart(std::span<const u8> rom, u64 offset, u64 size, const char* what)
+{
+	if (offset > rom.size() || size > rom.size() - offset)
+		throw std::runtime_error(std::string(what) + " is outside of the ROM");
+
+	return rom.subspan(offset, size);
+}
+
+/**
+ * @brief Get the contents of a file by its entry in the FAT.
+ */
+static std::span<const u8> fatFile(std::span<const u8> rom, std::span<const u8> fat, u16 fileID)
+{
+	if (fileID * 8u + 8 > fat.size())
+		throw std::runtime_error("file ID " + std::to_string(fileID) + " is outside of the FAT");
+
+	const u32 start = readU32(&fat[fileID * 8]);
+	const u32 end = readU32(&fat[fileID * 8 + 4]);
+
+	if (end < start)
+		throw std::runtime_error("file " + std::to_string(fileID) + " ends before it starts");
+
+	return romPart(rom, start, end - start, "a file");
+}
 
 static void dumpFntTree(
 	Extractor& extractor,
-	const std::vector<u32>& romU32,
+	std::span<const u8> rom,
 	const NDSDirectory& dir,
 	const fs::path& p,
-	u32 fatOffset
+	std::span<const u8> fat
 )
 {
 	extractor.writeDir(p);
@@ -18,56 +48,58 @@ static void dumpFntTree(
 	for (u32 i = 0; i < dir.files.size(); i++)
 	{
 		const u16 fid = dir.firstFileID + i;
-		const u32 start = romU32[(fatOffset + fid * 8) / 4];
-		const u32 size = romU32[(fatOffset + fid * 8 + 4) / 4] - start;
+		const std::span<const u8> file = fatFile(rom, fat, fid);
 
-		extractor.writeFile(p / dir.files[i], reinterpret_cast<const char*>(romU32.data()) + start, size);
+		extractor.writeFatFile(p / dir.files[i], fid, file.data(), file.size());
 	}
 
 	for (u32 i = 0; i < dir.dirs.size(); i++)
-		dumpFntTree(extractor, romU32, dir.dirs[i], p / dir.dirs[i].dirName, fatOffset);
+		dumpFntTree(extractor, rom, dir.dirs[i], p / dir.dirs[i].dirName, fat);
 }
 
 void Extractor::extract()
 {
-	const u32 ndsFileSize = fs::file_size(romPath);
+	if (fs::file_size(romPath) > oneGB)
+		throw std::length_error("the input file is larger than 1 GB");
+
+	// The ROM is only read as far as needed
+	const MappedFile rom(romPath);
+	extract(rom.data());
+}
 
-	if (ndsFileSize > oneGB)
+void Extractor::extract(std::span<const u8> rom)
+{
+	if (rom.size() > oneGB)
 		throw std::length_error("the input file is larger than 1 GB");
 
-	std::ifstream ndsFile;
-	fs::path outputPath;
-	ndsFile.open(romPath, std::ios::in | std::ios::binary);
-
-	if (!ndsFile.good())
-		throw std::runtime_error("failed to open file " + romPath.string());
-
-	std::vector<u32> romU32;
-	romU32.resize((ndsFileSize + 3) >> 2);
-
-	if (!ndsFile.read(reinterpret_cast<char*>(romU32.data()), ndsFileSize))
-		throw std::runtime_error("failed to read file " + romPath.string());
-
-	ndsFile.close();
-
-	std::span<u8> romU8 = {reinterpret_cast<u8*>(romU32.data()), ndsFileSize};
-
-	const u32 arm9Offset = romU32[8];
-	const u32 arm9Size   = romU32[11];
-	const u32 arm7Offset = romU32[12];
-	const u32 arm7Size   = romU32[15];
-	const u32 ovt9Offset = romU32[20];
-	const u32 ovt9Size   = romU32[21];
-	const u32 ovt7Offset = romU32[22];
-	const u32 ovt7Size   = romU32[23];
-	const u32 fntOffset  = romU32[16];
-	const u32 fntSize    = romU32[17];
-	const u32 fatOffset  = romU32[18];
-	const u32 fatSize    = romU32[19];
-	const u32 iconOffset = romU32[26];
-	const u32 rsaOffset  = romU32[32];
+	if (rom.size() < 0x4000)
+		throw std::length_error("the input file is too small to be a ROM");
+
+	const u32 arm9Offset = readU32(&rom[0x20]);
+	const u32 arm9Size   = readU32(&rom[0x2c]);
+	const u32 arm7Offset = readU32(&rom[0x30]);
+	const u32 arm7Size   = readU32(&rom[0x3c]);
+	const u32 ovt9Offset = readU32(&rom[0x50]);
+	const u32 ovt9Size   = readU32(&rom[0x54]);
+	const u32 ovt7Offset = readU32(&rom[0x58]);
+	const u32 ovt7Size   = readU32(&rom[0x5c]);
+	const u32 fntOffset  = readU32(&rom[0x40]);
+	const u32 fntSize    = readU32(&rom[0x44]);
+	const u32 fatOffset  = readU32(&rom[0x48]);
+	const u32 fatSize    = readU32(&rom[0x4c]);
+	const u32 iconOffset = readU32(&rom[0x68]);
+	const u32 rsaOffset  = readU32(&rom[0x80]);
 	const u32 rsaSize    = 136;
 
+	// The header of a truncated or damaged ROM may point past its end
+	const std::span<const u8> arm9 = romPart(rom, arm9Offset, arm9Size, "arm9.bin");
+	const std::span<const u8> arm7 = romPart(rom, arm7Offset, arm7Size, "arm7.bin");
+	const std::span<const u8> ovt9 = romPart(rom, ovt9Offset, ovt9Size, "the ARM9 overlay table");
+	const std::span<const u8> ovt7 = romPart(rom, ovt7Offset, ovt7Size, "the ARM7 overlay table");
+	const std::span<const u8> fnt  = romPart(rom, fntOffset, fntSize, "the FNT");
+	const std::span<const u8> fat  = romPart(rom, fatOffset, fatSize, "the FAT");
+	const std::span<const u8> rsa  = romPart(rom, rsaOffset, rsaSize, "the RSA signature");
+
 	const fs::path ov7Path = "overlay7";
 	const fs::path ov9Path = "overlay9";
 
@@ -75,17 +107,17 @@ void Extractor::extract()
 	writeDir(ov7Path);
 	writeDir(ov9Path);
 
-	writeFile("header.bin", romU32.data(), 0x4000);
-	writeFile("arm9.bin",    romU8.data() + arm9Offset, arm9Size);
-	writeFile("arm7.bin",    romU8.data() + arm7Offset, arm7Size);
-	writeFile("arm9ovt.bin", romU8.data() + ovt9Offset, ovt9Size);
-	writeFile("arm7ovt.bin", romU8.data() + ovt7Offset, ovt7Size);
+	writeFile("header.bin", rom.data(), 0x4000);
+	writeFile("arm9.bin",    arm9.data(), arm9.size());
+	writeFile("arm7.bin",    arm7.data(), arm7.size());
+	writeFile("arm9ovt.bin", ovt9.data(), ovt9.size());
+	writeFile("arm7ovt.bin", ovt7.data(), ovt7.size());
 
 	u32 iconSize;
 
 	if (iconOffset)
 	{
-		switch (readU16(romU8.data() + iconOffset))
+		switch (readU16(romPart(rom, iconOffset, 2, "the banner").data()))
 		{
 		default:
 			std::cout << WARNING "invalid icon / title ID, defaulting to 0x840\n";
@@ -110,23 +142,24 @@ void Extractor::extract()
 		iconSize = 0;
 	}
 
-	writeFile("banner.bin", &romU8[iconOffset], iconSize);
-	writeFile("fnt.bin", &romU8[fntOffset], fntSize);
-	writeFile("fat.bin", &romU8[fatOffset], fatSize);
-	writeFile("rsasig.bin", &romU8[rsaOffset], rsaSize);
+	const std::span<const u8> banner = romPart(rom, iconOffset, iconSize, "the banner");
+
+	writeFile("banner.bin", banner.data(), banner.size());
+	writeFile("fnt.bin", fnt.data(), fnt.size());
+	writeFile("fat.bin", fat.data(), fat.size());
+	writeFile("rsasig.bin", rsa.data(), rsa.size());
 
 	if (ovt9Size)
 	{
 		for (u32 i = 0; i < ovt9Size / 32; i++)
 		{
-			u16 fid = readU16(romU8.data() + ovt9Offset + i * 32 + 24);
-			u32 ovStart = romU32[(fatOffset + fid * 8) / 4];
-			u32 ovSize = romU32[(fatOffset + fid * 8 + 4) / 4] - ovStart;
+			u16 fid = readU16(&ovt9[i * 32 + 24]);
+			const std::span<const u8> overlay = fatFile(rom, fat, fid);
 			
-			fs::path outputPath = ov9Path / std::to_string(romU32[(ovt9Offset + i * 32) / 4]);
+			fs::path outputPath = ov9Path / std::to_string(readU32(&ovt9[i * 32]));
 			outputPath += ".bin";
 
-			writeFile(outputPath, &romU8[ovStart], ovSize);
+			writeFatFile(outputPath, fid, overlay.data(), overlay.size());
 		}
 	}
 
@@ -134,17 +167,16 @@ void Extractor::extract()
 	{
 		for (u32 i = 0; i < ovt7Size / 32; i++)
 		{
-			u16 fid = readU16(romU8.data() + ovt7Offset + i * 32 + 24);
-			u32 ovStart = romU32[(fatOffset + fid * 8) / 4];
-			u32 ovSize = romU32[(fatOffset + fid * 8 + 4) / 4] - ovStart;
+			u16 fid = readU16(&ovt7[i * 32 + 24]);
+			const std::span<const u8> overlay = fatFile(rom, fat, fid);
 
-			fs::path outputPath = ov7Path / std::to_string(romU32[(ovt7Offset + i * 32) / 4]);
+			fs::path outputPath = ov7Path / std::to_string(readU32(&ovt7[i * 32]));
 			outputPath += ".bin";
 
-			writeFile(outputPath, &romU8[ovStart], ovSize);
+			writeFatFile(outputPath, fid, overlay.data(), overlay.size());
 		}
 	}
 
-	NDSDirectory rootDir = buildFntTree(&romU8[fntOffset], 0xF000, fntSize);
-	dumpFntTree(*this, romU32, rootDir, "root", fatOffset);
+	NDSDirectory rootDir = buildFntTree(fnt.data(), 0xF000, fnt.size());
+	dumpFntTree(*this, rom, rootDir, "root", fat);
 }
@@ -0,0 +1,80 @@
+#include "hash.h"
+
+#include <bit>
+#include <cstring>
+
+static constexpr u64 prime1 = 0x9e3779b185ebca87;
+static constexpr u64 prime2 = 0xc2b2ae3d27d4eb4f;
+static constexpr u64 prime3 = 0x165667b19e3779f9;
+static constexpr u64 prime4 = 0x85ebca77c2b2ae63;
+static constexpr u64 prime5 = 0x27d4eb2f165667c5;
+
+static u64 read64(const u8* p)
+{
+	u64 v;
+	std::memcpy(&v, p, 8);
+	return v;
+}
+
+static u64 round(u64 acc, u64 input)
+{
+	return std::rotl(acc + input * prime2, 31) * prime1;
+}
+
+static u64 merge(u64 acc, u64 val)
+{
+	return (acc ^ round(0, val)) * prime1 + prime4;
+}
+
+u64 hash64(const void* data, std::size_t size, u64 seed)
+{
+	const u8* p = static_cast<const u8*>(data);
+	const u8* const end = p + size;
+	u64 h;
+
+	if (size >= 32)
+	{
+		u64 v1 = seed + prime1 + prime2;
+		u64 v2 = seed + prime2;
+		u64 v3 = seed;
+		u64 v4 = seed - prime1;
+
+		for (; end - p >= 32; p += 32)
+		{
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+		}
+
+		h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+		h = merge(h, v1);
+		h = merge(h, v2);
+		h = merge(h, v3);
+		h = merge(h, v4);
+	}
+	else
+		h = seed + prime5;
+
+	h += size;
+
+	for (; end - p >= 8; p += 8)
+		h = std::rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+
+	if (end - p >= 4)
+	{
+		h = std::rotl(h ^ readU32(p) * prime1, 23) * prime2 + prime3;
+		p += 4;
+	}
+
+	for (; p < end; ++p)
+		h = std::rotl(h ^ *p * prime5, 11) * prime1;
+
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	h *= prime3;
+	h ^= h >> 32;
+
+	return h;
+}
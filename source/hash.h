@@ -0,0 +1,14 @@
+#pragma once
+
+#include "common.h"
+
+/**
+ * @brief Compute the 64-bit xxHash (XXH64) of a block of data.
+ * 
+ * @param data Pointer to the data.
+ * @param size Size of the data.
+ * @param seed The seed of the hash.
+ * 
+ * @return The hash.
+ */
+u64 hash64(const void* data, std::size_t size, u64 seed = 0);
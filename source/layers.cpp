@@ -0,0 +1,184 @@
+#include "layers.h"
+
+#include <algorithm>
+#include <bit>
+#include <fstream>
+
+static std::string childKey(const std::string& dir, const std::string& name)
+{
+	return dir.empty() ? name : dir + '/' + name;
+}
+
+u64 InputFile::size() const
+{
+	return inMemory ? data.size() : fs::file_size(path);
+}
+
+void InputFile::read(void* dest, u64 size) const
+{
+	if (inMemory)
+	{
+		if (size > data.size())
+			throw std::runtime_error("failed to read file " + path.string());
+
+		std::copy_n(data.data(), size, static_cast<u8*>(dest));
+		return;
+	}
+
+	std::ifstream file(path, std::ios::binary | std::ios::in);
+
+	if (!file.is_open())
+		throw std::runtime_error("failed to open file " + path.string());
+
+	if (!file.read(static_cast<char*>(dest), size))
+		throw std::runtime_error("failed to read file " + path.string());
+}
+
+LayeredFS::LayeredFS(std::vector<fs::path> layers):
+	layers(std::move(layers)),
+	memoryFiles(this->layers.size())
+{
+	if (this->layers.size() > 32)
+		throw std::invalid_argument("too many source directories (at most 32 are supported)");
+
+	for (std::size_t i = 0; i < this->layers.size(); i++)
+	{
+		const fs::path& layerDir = this->layers[i];
+
+		if (!fs::is_directory(layerDir))
+			continue;
+
+		// Like looking up each path, this includes files in directories that are symlinks
+		for (const fs::directory_entry& dirEntry
+			: fs::recursive_directory_iterator(layerDir, fs::directory_options::follow_directory_symlink))
+		{
+			// The types come from the directory listing, so this doesn't stat every file
+			const bool isDirectory = dirEntry.is_directory();
+
+			if (!isDirectory && !dirEntry.is_regular_file())
+				continue;
+
+			add(i, dirEntry.path().lexically_relative(layerDir), isDirectory);
+		}
+	}
+}
+
+void LayeredFS::add(std::size_t layer, const fs::path& relativePath, bool isDirectory)
+{
+	Entry& entry = entries[relativePath.generic_string()];
+	(isDirectory ? entry.dirLayers : entry.fileLayers) |= 1u << layer;
+
+	children[relativePath.parent_path().generic_string()].insert(relativePath.filename().string());
+}
+
+void LayeredFS::addMemoryFiles(std::size_t layer, const std::unordered_map<std::string, std::span<const u8>>& files)
+{
+	for (const auto& [pathString, data] : files)
+	{
+		const fs::path path = pathString;
+
+		for (fs::path dir = path.parent_path(); !dir.empty(); dir = dir.parent_path())
+			add(layer, dir, true);
+
+		add(layer, path, false);
+		memoryFiles[layer][pathString] = data;
+	}
+}
+
+const LayeredFS::Entry* LayeredFS::find(const fs::path& path) const
+{
+	const auto it = entries.find(path.lexically_normal().generic_string());
+
+	return it != entries.end() ? &it->second : nullptr;
+}
+
+int LayeredFS::findFile(const fs::path& path, u32 layerMask) const
+{
+	const Entry* entry = find(path);
+
+	if (!entry || !(entry->fileLayers & layerMask))
+		return -1;
+
+	return std::countr_zero(entry->fileLayers & layerMask);
+}
+
+fs::path LayeredFS::resolve(const fs::path& path, u32 layerMask) const
+{
+	const int layer = findFile(path, layerMask);
+
+	return layer < 0 ? fs::path() : layers[layer] / path;
+}
+
+std::optional<InputFile> LayeredFS::open(const fs::path& path, u32 layerMask) const
+{
+	const int layer = findFile(path, layerMask);
+
+	if (layer < 0)
+		return std::nullopt;
+
+	InputFile file;
+	file.path = layers[layer] / path;
+	file.layer = layer;
+
+	const auto& layerMemoryFiles = memoryFiles[layer];
+
+	if (const auto it = layerMemoryFiles.find(path.lexically_normal().generic_string()); it != layerMemoryFiles.end())
+	{
+		file.inMemory = true;
+		file.data = it->second;
+	}
+
+	return file;
+}
+
+bool LayeredFS::isFile(std::size_t layer, const fs::path& path) const
+{
+	const Entry* entry = find(path);
+
+	return entry && entry->fileLayers >> layer & 1;
+}
+
+bool LayeredFS::isDirectory(std::size_t layer, const fs::path& path) const
+{
+	const Entry* entry = find(path);
+
+	return entry && entry->dirLayers >> layer & 1;
+}
+
+std::vector<LayeredFS::DirEntry> LayeredFS::list(const fs::path& dir, u32 layerMask) const
+{
+	std::vector<DirEntry> result;
+	const std::string dirKey = dir.lexically_normal().generic_string();
+	const auto it = children.find(dirKey);
+
+	if (it == children.end())
+		return result;
+
+	for (const std::string& name : it->second)
+	{
+		const Entry& entry = entries.at(childKey(dirKey, name));
+
+		if ((entry.fileLayers | entry.dirLayers) & layerMask)
+			result.emplace_back(name, (entry.dirLayers & layerMask) != 0);
+	}
+
+	return result;
+}
+
+std::vector<fs::path> LayeredFS::files(std::size_t layer, const fs::path& dir) const
+{
+	std::vector<fs::path> result;
+
+	for (const DirEntry& dirEntry : list(dir, 1u << layer))
+	{
+		if (dirEntry.isDirectory)
+		{
+			for (fs::path& path : files(layer, dir / dirEntry.name))
+				result.push_back(std::move(path));
+		}
+		else
+			result.push_back(dir / dirEntry.name);
+	}
+
+	return result;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief A file in one of the layers of a LayeredFS, either on disk or in memory.
+ */
+struct InputFile
+{
+	fs::path path;            ///< including the layer directory
+	std::size_t layer = 0;
+	bool inMemory = false;
+	std::span<const u8> data; ///< the contents, if the file is in memory
+
+	u64 size() const;
+
+	/**
+	 * @brief Read the beginning of the file.
+	 *
+	 * @throw std::runtime_error if the file is shorter.
+	 */
+	void read(void* dest, u64 size) const;
+};
+
+/**
+ * @brief Source directories stacked on top of each other, like the layers of an image.
+ *
+ * Every layer is walked once when the index is built, so looking up a path
+ * afterwards doesn't touch the file system. Changes made to the directories
+ * after that aren't seen.
+ *
+ * Paths are relative to the layers, e.g. `root/data/a.bin`.
+ */
+class LayeredFS
+{
+public:
+	static constexpr u32 allLayers = ~0u;
+
+	struct DirEntry
+	{
+		std::string name;
+		bool isDirectory;
+	};
+
+	/**
+	 * @param layers The directories, from the highest priority to the lowest.
+	 * Directories that don't exist are treated as empty. At most 32.
+	 */
+	explicit LayeredFS(std::vector<fs::path> layers);
+
+	std::size_t layerCount() const { return layers.size(); }
+	const fs::path& layer(std::size_t index) const { return layers[index]; }
+
+	/**
+	 * @brief Add files that are in memory instead of on disk to a layer, e.g. the files of a mapped ROM.
+	 *
+	 * @param files The contents of the files by their paths, which have to stay valid.
+	 */
+	void addMemoryFiles(std::size_t layer, const std::unordered_map<std::string, std::span<const u8>>& files);
+
+	/**
+	 * @brief Find the layer with the highest priority that has a regular file at a path.
+	 *
+	 * @param layerMask Only the layers whose bits are set are searched.
+	 *
+	 * @return The index of the layer, or -1 if none of them has the file.
+	 */
+	int findFile(const fs::path& path, u32 layerMask = allLayers) const;
+
+	/**
+	 * @brief Get the path of the file in the layer with the highest priority that has it.
+	 *
+	 * @return The path including the layer directory, or an empty path if none of them has the file.
+	 */
+	fs::path resolve(const fs::path& path, u32 layerMask = allLayers) const;
+
+	/**
+	 * @brief Get the file in the layer with the highest priority that has it.
+	 *
+	 * @return The file, or std::nullopt if none of the layers has it.
+	 */
+	std::optional<InputFile> open(const fs::path& path, u32 layerMask = allLayers) const;
+
+	bool isFile(std::size_t layer, const fs::path& path) const;
+	bool isDirectory(std::size_t layer, const fs::path& path) const;
+
+	/**
+	 * @brief List a directory as merged from the given layers, sorted by name.
+	 *
+	 * An entry counts as a directory if it is one in any of the layers.
+	 */
+	std::vector<DirEntry> list(const fs::path& dir, u32 layerMask = allLayers) const;
+
+	/**
+	 * @brief Get the regular files in a directory of a single layer and all of its subdirectories, sorted.
+	 */
+	std::vector<fs::path> files(std::size_t layer, const fs::path& dir) const;
+
+private:
+	struct Entry
+	{
+		u32 fileLayers = 0; // the layers that have a regular file at the path
+		u32 dirLayers = 0;  // the layers that have a directory at the path
+	};
+
+	std::vector<fs::path> layers;
+	std::unordered_map<std::string, Entry> entries;
+	std::unordered_map<std::string, std::set<std::string>> children; // the names in each directory
+	std::vector<std::unordered_map<std::string, std::span<const u8>>> memoryFiles; // for each layer
+
+	void add(std::size_t layer, const fs::path& relativePath, bool isDirectory);
+
+	const Entry* find(const fs::path& path) const;
+};
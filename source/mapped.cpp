@@ -0,0 +1,118 @@
+#include "mapped.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const fs::path& path)
+{
+	const std::uintmax_t size = fs::file_size(path);
+
+	// Empty files can't be mapped
+	if (size == 0)
+		return;
+
+#ifdef _WIN32
+	const HANDLE file = CreateFileW(
+		path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr
+	);
+
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("failed to open file " + path.string());
+
+	const HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+
+	if (!mapping)
+		throw std::runtime_error("failed to map file " + path.string());
+
+	// The view keeps the file open
+	const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	if (!view)
+		throw std::runtime_error("failed to map file " + path.string());
+#else
+	const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		throw std::runtime_error("failed to open file " + path.string());
+
+	// The mapping keeps the file open
+	const void* view = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (view == MAP_FAILED)
+		throw std::runtime_error("failed to map file " + path.string());
+#endif
+
+	contents = {static_cast<const u8*>(view), size};
+}
+
+MappedFile::~MappedFile()
+{
+	if (contents.empty())
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(contents.data());
+#else
+	munmap(const_cast<u8*>(contents.data()), contents.size());
+#endif
+}
+
+struct IndexingExtractor : Extractor
+{
+	std::unordered_map<std::string, std::span<const u8>>& files;
+	std::unordered_set<std::string>& dirs;
+
+	IndexingExtractor(
+		const fs::path& romPath,
+		std::unordered_map<std::string, std::span<const u8>>& files,
+		std::unordered_set<std::string>& dirs
+	):
+		Extractor(romPath),
+		files(files),
+		dirs(dirs)
+	{}
+
+	virtual void writeFile(const fs::path& shortPath, const void* data, std::size_t size) override
+	{
+		files[shortPath.generic_string()] = {static_cast<const u8*>(data), size};
+	}
+
+	virtual void writeDir(const fs::path& shortPath) override
+	{
+		dirs.insert(shortPath.generic_string());
+	}
+};
+
+MappedRom::MappedRom(const fs::path& path):
+	file(path)
+{
+	IndexingExtractor(path, files, dirs).extract(file.data());
+}
+
+std::unique_ptr<MappedRom> MappedRom::open()
+{
+	if (!fs::is_regular_file(mappedCleanRomPath))
+		return nullptr;
+
+	return std::make_unique<MappedRom>(mappedCleanRomPath);
+}
+
+const std::span<const u8>* MappedRom::find(const fs::path& path) const
+{
+	const auto it = files.find(path.lexically_normal().generic_string());
+
+	return it != files.end() ? &it->second : nullptr;
+}
+
+bool MappedRom::isDirectory(const fs::path& path) const
+{
+	return dirs.contains(path.lexically_normal().generic_string());
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "common.h"
+
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+/**
+ * @brief A file mapped into memory, read-only.
+ */
+class MappedFile
+{
+	std::span<const u8> contents;
+
+public:
+	MappedFile(const fs::path& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::span<const u8> data() const { return contents; }
+};
+
+// Where `init --mapped` puts the clean ROM instead of extracting it to clean/raw
+inline const fs::path mappedCleanRomPath = fs::path("clean") / "rom.nds";
+
+/**
+ * @brief The clean ROM of a project created with `init --mapped`.
+ *
+ * The ROM is mapped into memory and indexed once by its FAT and FNT, so that its
+ * files can be used like the ones in clean/raw without being extracted.
+ */
+class MappedRom
+{
+	MappedFile file;
+	std::unordered_map<std::string, std::span<const u8>> files;
+	std::unordered_set<std::string> dirs;
+
+public:
+	MappedRom(const fs::path& path);
+
+	/**
+	 * @brief Open the clean ROM of the project in the current directory.
+	 *
+	 * @return The ROM, or nullptr if the project has its files in clean/raw instead.
+	 */
+	static std::unique_ptr<MappedRom> open();
+
+	std::span<const u8> data() const { return file.data(); }
+
+	/**
+	 * @brief Get a file of the ROM by the path it would have in clean/raw.
+	 *
+	 * @return The contents of the file, or nullptr if the ROM doesn't have it.
+	 */
+	const std::span<const u8>* find(const fs::path& path) const;
+
+	bool isDirectory(const fs::path& path) const;
+
+	/**
+	 * @brief Get every file of the ROM, by the path it would have in clean/raw.
+	 */
+	const std::unordered_map<std::string, std::span<const u8>>& allFiles() const { return files; }
+};
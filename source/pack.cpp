@@ -1,18 +1,73 @@
 #include <filesystem>
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <map>
+#include <span>
 #include <cstring>
 
 #include "common.h"
 #include "config.h"
 #include "crc.h"
 #include "blz.hpp"
+#include "cache.h"
+#include "hash.h"
+#include "layers.h"
+#include "mapped.h"
+#include "pack.h"
+#include "parallel.h"
+#include "record.h"
+#include "writer.h"
+
+// The first layers of the source index, see indexSources
+static constexpr std::size_t finalLayer          = 0;
+static constexpr std::size_t toBeCompressedLayer = 1;
+static constexpr std::size_t baseLayer           = 2;
+
+// Where the build stores the tables and the compressed files that it generates
+static const fs::path modifiedFinalPath = fs::path("modified") / "final";
+
+/**
+ * @brief Get the source directories, from the highest priority to the lowest:
+ * modified/final, modified/to-be-compressed, modified/base, the layers from the
+ * config (the last one first) and clean/raw.
+ * 
+ * @param mapped Whether the project has a mapped clean ROM, which takes the place of clean/raw.
+ */
+static std::vector<fs::path> sourceDirs(const Config& config, bool mapped)
+{
+	std::vector<fs::path> dirs = {
+		modifiedFinalPath,
+		fs::path("modified") / "to-be-compressed",
+		fs::path("modified") / "base"
+	};
+
+	dirs.insert(dirs.end(), config.layers.rbegin(), config.layers.rend());
+	dirs.push_back(mapped ? mappedCleanRomPath : fs::path("clean") / "raw");
+
+	return dirs;
+}
+
+/**
+ * @brief Index the source directories (see sourceDirs).
+ * 
+ * @param cleanRom If given, the files of the mapped clean ROM take the place of clean/raw.
+ */
+static LayeredFS indexSources(const Config& config, const MappedRom* cleanRom)
+{
+	LayeredFS sources(sourceDirs(config, cleanRom));
+
+	if (cleanRom)
+		sources.addMemoryFiles(sources.layerCount() - 1, cleanRom->allFiles());
+
+	return sources;
+}
 
 static void checkFileSize(const fs::path& path, std::size_t size, std::size_t maxSize)
 {
@@ -26,24 +81,25 @@ static void checkFileSize(const fs::path& path, std::size_t size, std::size_t ma
 
 struct OverlayEntry
 {
-	u32 start;
-	u32 end;
 	u16 fileID;
+	u32 ovtIndex;          // the index of the entry in the overlay table
+	std::size_t itemIndex; // the index of the overlay in RomPlan::items
 };
 
-static void romCheckBounds(std::vector<u8>& rom, u32 requiredSize, u8 padding)
+static void romCheckBounds(u32 requiredSize)
 {
 	if (oneGB < requiredSize)
 		throw std::length_error("ROM trying to grow larger than 1 GB");
-
-	if (rom.size() < requiredSize)
-		rom.resize(requiredSize, padding);
 }
 
-NDSDirectory buildFntTree(u8* fnt, u32 dirID, u32 fntSize)
+NDSDirectory buildFntTree(const u8* fnt, u32 dirID, u32 fntSize)
 {
 	NDSDirectory dir;
 	u32 dirOffset = (dirID & 0xFFF) * 8;
+
+	if (dirOffset + 8 > fntSize)
+		throw std::runtime_error("invalid FNT: directory " + std::to_string(dirID) + " is outside of it");
+
 	u32 subOffset = readU32(fnt + dirOffset);
 	dir.firstFileID = readU16(fnt + dirOffset + 4);
 	dir.directoryID = dirID;
@@ -68,6 +124,9 @@ NDSDirectory buildFntTree(u8* fnt, u32 dirID, u32 fntSize)
 		bool isSubdir = len & 0x80;
 		len &= 0x7F;
 
+		if (subOffset + relOffset + len + (isSubdir ? 2 : 0) > fntSize)
+			throw std::runtime_error("invalid FNT: an entry of directory " + std::to_string(dirID) + " is cut off");
+
 		name = std::string(reinterpret_cast<const char*>(fnt + subOffset + relOffset), len);
 		relOffset += len;
 
@@ -114,9 +173,17 @@ static u32 fntDirectoryIndex(NDSDirectory& parent, const std::string& dataDir)
 	return ~0u;
 }
 
+/**
+ * @brief Add the files in new directories of the source layers to the FNT tree.
+ * 
+ * @param dataDir The directory that corresponds to `ndsDir`, relative to the layers.
+ * @param layerMask The layers that new files are taken from.
+ */
 static bool fntAddNewFiles(
 	NDSDirectory& ndsDir,
+	const LayeredFS& sources,
 	const fs::path& dataDir,
+	u32 layerMask,
 	u16& freeFileID,
 	u16& freeDirID,
 	bool newDir
@@ -124,24 +191,26 @@ static bool fntAddNewFiles(
 {
 	bool modified = false;
 
-	for (const fs::path& p : fs::directory_iterator(dataDir))
+	for (const LayeredFS::DirEntry& entry : sources.list(dataDir, layerMask))
 	{
-		if (!fs::is_directory(p))
+		const fs::path p = dataDir / entry.name;
+
+		if (!entry.isDirectory)
 		{
-			if (newDir || std::ranges::contains(ndsDir.files, p.filename().string()))
+			if (newDir || std::ranges::contains(ndsDir.files, entry.name))
 				continue;
 
 			throw std::runtime_error(
-				"new file " + p.string()
+				"new file " + sources.resolve(p, layerMask).string()
 				+ " is not in a new directory"
 			);
 		}
 
-		u32 i = fntDirectoryIndex(ndsDir, p.filename().string());
+		u32 i = fntDirectoryIndex(ndsDir, entry.name);
 
 		if (i != ~0u) // if the directory already exists in the fnt
 		{
-			modified = fntAddNewFiles(ndsDir.dirs[i], p, freeFileID, freeDirID, newDir) || modified;
+			modified = fntAddNewFiles(ndsDir.dirs[i], sources, p, layerMask, freeFileID, freeDirID, newDir) || modified;
 
 			continue;
 		}
@@ -149,15 +218,15 @@ static bool fntAddNewFiles(
 		NDSDirectory& dir = ndsDir.dirs.emplace_back();
 		dir.firstFileID = freeFileID;
 		dir.directoryID = freeDirID;
-		dir.dirName = p.filename().string();
+		dir.dirName = entry.name;
 
-		for (const fs::path& sp : fs::directory_iterator(p))
+		for (const LayeredFS::DirEntry& subEntry : sources.list(p, layerMask))
 		{
-			if (fs::is_regular_file(sp))
+			if (!subEntry.isDirectory)
 			{
-				std::cout << "File " << sp << " obtained File ID ";
+				std::cout << "File " << sources.resolve(p / subEntry.name, layerMask) << " obtained File ID ";
 				std::cout << (dir.firstFileID + dir.files.size()) << '\n';
-				dir.files.push_back(sp.filename().string());
+				dir.files.push_back(subEntry.name);
 			}
 		}
 
@@ -165,7 +234,7 @@ static bool fntAddNewFiles(
 		freeDirID++;
 		modified = true;
 
-		fntAddNewFiles(dir, p, freeFileID, freeDirID, true);
+		fntAddNewFiles(dir, sources, p, layerMask, freeFileID, freeDirID, true);
 	}
 
 	return modified;
@@ -244,14 +313,13 @@ static u32 fntWriteDirectory(const NDSDirectory& dir, u8* fnt, u32 offset, u32 p
 
 }
 
-static void fntRebuild(std::vector<u8>& rom, u32 fntOffset, const NDSDirectory& root, u32& size, u8 padding)
+static void fntRebuild(std::vector<u8>& fnt, const NDSDirectory& root)
 {
 	u32 fntHeaderSize = fntByteCountHeader(root);
 	u32 fntFnSize = fntByteCountFn(root);
-	size = fntHeaderSize + fntFnSize;
 
-	romCheckBounds(rom, fntOffset + size, padding);
-	fntWriteDirectory(root, &rom[fntOffset], fntHeaderSize, fntHeaderSize / 8);
+	fnt.assign(fntHeaderSize + fntFnSize, 0);
+	fntWriteDirectory(root, fnt.data(), fntHeaderSize, fntHeaderSize / 8);
 }
 
 static u32 alignAddress(u32 address, u32 align)
@@ -277,64 +345,263 @@ static void readInputFile(const fs::path& path, void* dest, std::size_t size)
 		throw std::runtime_error("failed to read file " + path.string());
 }
 
-static fs::path findInputFile(const fs::path& path)
+static bool isNitroFSFile(const fs::path& path)
 {
-	const fs::path toBeCompressedPath = "modified" / ("to-be-compressed" / path);
+	return *path.begin() == "root";
+}
 
-	if (fs::is_regular_file(toBeCompressedPath))
-		throw std::runtime_error("compression is only supported for overlays, not for " + path.string());
+static InputFile findInputFile(const LayeredFS& sources, const fs::path& path)
+{
+	if (sources.isFile(toBeCompressedLayer, path))
+	{
+		// arm9.bin and files in root are compressed to modified/final before the ROM is built
+		if (path == "arm9.bin" || isNitroFSFile(path))
+		{
+			InputFile compressedFile;
+			compressedFile.path = sources.layer(finalLayer) / path;
+			compressedFile.layer = finalLayer;
 
-	const fs::path modifiedFinalPath = "modified" / ("final" / path);
+			return compressedFile;
+		}
 
-	if (fs::is_regular_file(modifiedFinalPath))
-		return modifiedFinalPath;
+		throw std::runtime_error("compression is only supported for overlays, arm9.bin and files in root, not for " + path.string());
+	}
 
-	const fs::path modifiedBasePath = "modified" / ("base" / path);
+	std::optional<InputFile> inputFile = sources.open(path);
 
-	if (fs::is_regular_file(modifiedBasePath))
-		return modifiedBasePath;
+	if (!inputFile)
+		throw std::runtime_error("could not find file: " + path.string());
 
-	const fs::path cleanRawPath = "clean" / ("raw" / path);
+	return std::move(*inputFile);
+}
 
-	if (fs::is_regular_file(cleanRawPath))
-		return cleanRawPath;
+static bool needsCompression(const LayeredFS& sources, const fs::path& path)
+{
+	if (!sources.isFile(toBeCompressedLayer, path))
+		return false;
 
-	throw std::runtime_error("could not find file: " + path.string());
+	return !sources.isFile(finalLayer, path)
+		|| fs::last_write_time(sources.layer(finalLayer) / path)
+			< fs::last_write_time(sources.layer(toBeCompressedLayer) / path);
 }
 
-static void writeOverlay(
-	std::vector<u8>& rom,
-	u32 ovID,
-	OverlayEntry& entry,
-	const fs::path& dir,
-	u32& romOffset,
-	u32 ovtOffset,
-	u8 padding
+static void findStaleOverlays(
+	const LayeredFS& sources,
+	std::vector<fs::path>& paths,
+	const InputFile& ovtFile,
+	const fs::path& dir
 )
 {
-	const fs::path path = dir / (std::to_string(ovID) + ".bin");
+	const u32 ovtSize = ovtFile.size();
+	std::vector<u8> ovt(ovtSize);
+	ovtFile.read(ovt.data(), ovtSize);
+
+	for (u32 i = 0; i < ovtSize / 32; i++)
+	{
+		const fs::path path = dir / (std::to_string(readU32(&ovt[i * 32])) + ".bin");
+
+		if (needsCompression(sources, path))
+			paths.push_back(path);
+	}
+}
+
+/**
+ * @brief Get the format that a file in modified/to-be-compressed is compressed with.
+ * 
+ * @return BLZ for overlays and arm9.bin, the format given by the compression
+ * rules for files in root, or Codec::Format::none if no rule matches.
+ */
+static Codec::Format compressionFormat(const fs::path& path, const Config& config)
+{
+	return isNitroFSFile(path) ? config.compressionFormat(path) : Codec::Format::blz;
+}
+
+static void findStaleNitroFSFiles(const LayeredFS& sources, std::vector<fs::path>& paths, const Config& config)
+{
+	for (const fs::path& path : sources.files(toBeCompressedLayer, "root"))
+	{
+		if (compressionFormat(path, config) == Codec::Format::none)
+		{
+			throw std::runtime_error(
+				"no compression rule matches " + (sources.layer(toBeCompressedLayer) / path).string()
+				+ " (add a 'compress <pattern> <format>' line to .neondst)"
+			);
+		}
+
+		if (needsCompression(sources, path))
+			paths.push_back(path);
+	}
+}
+
+struct CompressedFile
+{
+	std::vector<u8> data;
+	bool cached = false;
+	bool pending = false; // not compressed because of a dry run
+};
+
+using CompressedFiles = std::map<fs::path, CompressedFile>;
+
+static void printCompression(const fs::path& path, const CompressedFile& file)
+{
 	const fs::path toBeCompressedPath = "modified" / ("to-be-compressed" / path);
 	const fs::path finalPath          = "modified" / ("final" / path);
 
-	const bool toBeCompressedExists = fs::is_regular_file(toBeCompressedPath);
-	const bool finalExists          = fs::is_regular_file(finalPath);
+	if (file.cached)
+		std::cout << "Using cached compressed data for " << toBeCompressedPath << " -> " << finalPath << "\n" WARNING;
+	else
+		std::cout << "Compressing " << toBeCompressedPath << " -> " << finalPath << "\n" WARNING;
 
-	u32 size;
-	bool clean = false;
+	std::cout << "the compression feature is experimental; it may produce incorrect results\n";
+}
 
-	if (toBeCompressedExists
-		&& (!finalExists || fs::last_write_time(finalPath) < fs::last_write_time(toBeCompressedPath)))
+/**
+ * @brief Compress a file with BLZ, or get its compressed data from the cache.
+ * 
+ * @param path The path of the file, relative to modified/to-be-compressed.
+ * @param uncompressedData The contents of the file.
+ * @param arm9Load The RAM address that arm9.bin is loaded to.
+ * @param jobs The number of threads for the match search.
+ * @param result Receives the compressed data.
+ */
+static void compressBLZ(
+	const fs::path& path,
+	const std::vector<u8>& uncompressedData,
+	const Config& config,
+	u32 arm9Load,
+	const CompressionCache& cache,
+	unsigned jobs,
+	CompressedFile& result
+)
+{
+	// The beginning of arm9.bin is stored uncompressed in front of the compressed data
+	const std::size_t headSize = path == "arm9.bin" ? arm9UncompressedSize : 0;
+
+	if (headSize && uncompressedData.size() <= headSize)
+		throw std::runtime_error("invalid arm9.bin: " + ("modified" / ("to-be-compressed" / path)).string());
+
+	const std::span<const u8> tail = std::span(uncompressedData).subspan(headSize);
+
+	const BLZ::Level level = config.compressionLevel(path);
+	const fs::path cacheEntryPath = cache.entryPath(tail, level, config.padding);
+
+	result.cached = cache.load(cacheEntryPath, tail.size(), result.data);
+
+	if (result.cached)
+		result.data.insert(result.data.begin(), headSize, 0);
+	else
 	{
-		const u32 uncompressedSize = fs::file_size(toBeCompressedPath);
-		std::vector<u8> uncompressedData(uncompressedSize);
+		// Every thread keeps its working memory for the next file
+		thread_local BLZ::Scratch scratch;
 
-		readInputFile(toBeCompressedPath, uncompressedData.data(), uncompressedSize);
+		result.data.resize(headSize + BLZ::compressBound(tail.size()));
+		const std::span<u8> output = std::span(result.data).subspan(headSize);
 
-		std::cout << "Compressing " << toBeCompressedPath << " -> " << finalPath << "\n" WARNING;
-		std::cout << "the compression feature is experimental; it may produce incorrect results\n";
+		// The compressed data of the previous version can be reused from its end up to the first change
+		std::vector<u8> previousData;
+		std::vector<u8> previousCompressed;
+		std::size_t compressedSize;
+
+		if (level != BLZ::Level::max
+			&& cache.loadPrevious(path, previousData)
+			&& cache.load(cache.entryPath(previousData, level, config.padding), previousData.size(), previousCompressed))
+		{
+			compressedSize = BLZ::recompress(
+				tail, previousData, previousCompressed, output, scratch, config.padding, level, jobs
+			);
+		}
+		else
+			compressedSize = BLZ::compress(tail, output, scratch, config.padding, level, jobs);
+
+		result.data.resize(headSize + compressedSize);
+		cache.store(cacheEntryPath, output.first(compressedSize));
+	}
+
+	cache.storePrevious(path, tail);
+
+	if (headSize)
+	{
+		std::copy_n(uncompressedData.begin(), headSize, result.data.begin());
+		writeU32(&result.data[arm9CompressedEndOffset], arm9Load + result.data.size());
+	}
+}
+
+/**
+ * @brief Compress a file with one of the BIOS formats, or get its compressed data from the cache.
+ */
+static void compressWithCodec(
+	const std::vector<u8>& uncompressedData,
+	Codec::Format format,
+	const CompressionCache& cache,
+	CompressedFile& result
+)
+{
+	const fs::path cacheEntryPath = cache.entryPath(uncompressedData, format);
+
+	result.cached = cache.load(cacheEntryPath, format, uncompressedData.size(), result.data);
+
+	if (!result.cached)
+	{
+		result.data = Codec::compress(uncompressedData, format);
+		cache.store(cacheEntryPath, result.data);
+	}
+}
+
+/**
+ * @brief Get the RAM address that arm9.bin is loaded to, as the built ROM's header will give it.
+ */
+static u32 arm9LoadAddress(const LayeredFS& sources, const Config& config)
+{
+	if (config.arm9Load != Config::keep)
+		return config.arm9Load;
+
+	u8 header[0x2c];
+	findInputFile(sources, "header.bin").read(header, sizeof(header));
+
+	return readU32(header + 0x28);
+}
+
+/**
+ * @brief Compress files from modified/to-be-compressed to modified/final in parallel.
+ * 
+ * Files whose compressed data is found in the cache aren't compressed again.
+ * Overlays and arm9.bin are compressed with BLZ, files in root as given by
+ * the compression rules.
+ * 
+ * @param paths The paths of the files, relative to modified/to-be-compressed.
+ * @param arm9Load The RAM address that arm9.bin is loaded to.
+ * 
+ * @return The compressed data of each file.
+ */
+static CompressedFiles compressFiles(
+	const std::vector<fs::path>& paths,
+	const Config& config,
+	u32 arm9Load,
+	unsigned jobs
+)
+{
+	const CompressionCache cache(config.cachePath);
+	std::vector<CompressedFile> results(paths.size());
+
+	// With fewer files than threads, the rest of the threads search for matches within each file
+	const unsigned jobsPerFile = std::max<std::size_t>(1, jobs / std::max<std::size_t>(1, paths.size()));
+
+	parallelFor(paths.size(), jobs, [&](std::size_t i)
+	{
+		const fs::path toBeCompressedPath = "modified" / ("to-be-compressed" / paths[i]);
+		const fs::path finalPath          = "modified" / ("final" / paths[i]);
 
-		const auto compressedData = BLZ::compress(uncompressedData, padding);
-		size = compressedData.size();
+		const u32 fileSize = fs::file_size(toBeCompressedPath);
+		std::vector<u8> uncompressedData(fileSize);
+
+		readInputFile(toBeCompressedPath, uncompressedData.data(), fileSize);
+
+		CompressedFile& result = results[i];
+
+		if (const Codec::Format format = compressionFormat(paths[i], config); format != Codec::Format::blz)
+			compressWithCodec(uncompressedData, format, cache, result);
+		else
+			compressBLZ(paths[i], uncompressedData, config, arm9Load, cache, jobsPerFile, result);
 
 		fs::create_directories(finalPath.parent_path());
 		std::ofstream compressedFile(finalPath, std::ios::binary | std::ios::out);
@@ -342,111 +609,399 @@ static void writeOverlay(
 		if (!compressedFile.is_open())
 			throw std::runtime_error("failed to open file " + finalPath.string());
 
-		if (!compressedFile.write(reinterpret_cast<const char*>(compressedData.data()), size))
+		if (!compressedFile.write(reinterpret_cast<const char*>(result.data.data()), result.data.size()))
 			throw std::runtime_error("failed to write file " + finalPath.string());
+	});
 
-		std::cout << "Replacing overlay " << ovID << " with " << finalPath << '\n';
+	CompressedFiles compressedFiles;
 
-		romCheckBounds(rom, romOffset + size, padding);
-		std::memcpy(&rom[romOffset], compressedData.data(), size);
-	}
-	else if (finalExists)
+	for (std::size_t i = 0; i < paths.size(); ++i)
+		compressedFiles.emplace(paths[i], std::move(results[i]));
+
+	return compressedFiles;
+}
+
+/**
+ * @brief A part of the ROM and where its bytes come from.
+ */
+struct RomItem
+{
+	std::string name;          ///< e.g. "arm9.bin", "fat.bin" or "root/data/a.bin"
+	u32 offset = 0;
+	u32 size = 0;
+	fs::path sourcePath;       ///< the file that the bytes are read from, or empty if they are generated
+	std::span<const u8> data;  ///< the bytes, if they are already in memory
+	bool uncompressed = false; ///< the size is that of the uncompressed file (only in a dry run)
+	bool mapped = false;       ///< the bytes are those of a file in the mapped clean ROM
+	int fileID = -1;           ///< the entry of the FAT that points to the item, if any
+};
+
+/**
+ * @brief Read an item from an input file. A file in memory isn't copied.
+ */
+static void setSource(RomItem& item, const InputFile& file)
+{
+	item.sourcePath = file.path;
+
+	if (file.inMemory)
 	{
-		std::cout << "Replacing overlay " << ovID << " with " << finalPath << '\n';
+		item.data = file.data.first(item.size);
+		item.mapped = true;
+	}
+}
 
-		size = fs::file_size(finalPath);
-		romCheckBounds(rom, romOffset + size, padding);
-		readInputFile(finalPath, &rom[romOffset], size);
+/**
+ * @brief The complete layout of a ROM, computed before any of it is written.
+ */
+struct RomPlan
+{
+	std::vector<u8> header; ///< the first 0x4000 bytes of the ROM
+	std::vector<u8> ovt9;
+	std::vector<u8> ovt7;
+	std::vector<u8> fnt;
+	std::vector<u8> fat;
+	u32 headerSize;         ///< the size of header.bin, 0x200 or 0x4000
+	u32 size;               ///< the used size up to the end of the RSA signature
+	u32 capacity;           ///< the device capacity given by the header
+	std::vector<RomItem> items; ///< sorted by offset, without gaps between them
+};
+
+/**
+ * @brief Mark the files that would be compressed without compressing them.
+ */
+static CompressedFiles pendingFiles(const std::vector<fs::path>& paths)
+{
+	CompressedFiles compressedFiles;
+
+	for (const fs::path& path : paths)
+		compressedFiles[path].pending = true;
+
+	return compressedFiles;
+}
+
+/**
+ * @brief Set the source and size of a file that is compressed at build time.
+ * 
+ * @return Whether the file is compressed at build time.
+ */
+static bool planCompressedFile(RomItem& item, const fs::path& path, const CompressedFiles& compressedFiles)
+{
+	const auto it = compressedFiles.find(path);
+
+	if (it == compressedFiles.end())
+		return false;
+
+	const CompressedFile& file = it->second;
+
+	if (file.pending)
+	{
+		item.sourcePath = "modified" / ("to-be-compressed" / path);
+		item.size = fs::file_size(item.sourcePath);
+		item.uncompressed = true;
 	}
-	else if (const fs::path basePath = "modified" / ("base" / path);
-		fs::is_regular_file(basePath))
+	else
 	{
-		std::cout << "Replacing overlay " << ovID << " with " << basePath << '\n';
+		printCompression(path, file);
+
+		item.sourcePath = "modified" / ("final" / path);
+		item.data = file.data;
+		item.size = file.data.size();
+	}
 
-		size = fs::file_size(basePath);
-		romCheckBounds(rom, romOffset + size, padding);
-		readInputFile(basePath, &rom[romOffset], size);
+	return true;
+}
+
+static void planOverlay(
+	RomPlan& plan,
+	const LayeredFS& sources,
+	u32 ovID,
+	OverlayEntry& entry,
+	std::vector<u8>& ovt,
+	const fs::path& dir,
+	u32& romOffset,
+	const CompressedFiles& compressedFiles,
+	const Config& config
+)
+{
+	const fs::path path = dir / (std::to_string(ovID) + ".bin");
+	const fs::path finalPath = "modified" / ("final" / path);
+
+	RomItem& item = plan.items.emplace_back(path.generic_string(), romOffset);
+	bool clean = false;
+
+	if (planCompressedFile(item, path, compressedFiles))
+	{
+		std::cout << "Replacing overlay " << ovID << " with " << item.sourcePath << '\n';
 	}
+	else if (const auto file = sources.open(path, ~(1u << toBeCompressedLayer)); !file)
+		throw std::runtime_error("could not find overlay file: " + path.string());
 	else
 	{
-		clean = true;
-		const fs::path cleanPath = "clean" / ("raw" / path);
-
-		if (!fs::is_regular_file(cleanPath))
-			throw std::runtime_error("could not find overlay file: " + path.string());
+		item.size = file->size();
+		setSource(item, *file);
+		clean = file->layer == sources.layerCount() - 1;
 
-		size = fs::file_size(cleanPath);
-		romCheckBounds(rom, romOffset + size, padding);
-		readInputFile(cleanPath, &rom[romOffset], size);
+		if (!clean)
+			std::cout << "Replacing overlay " << ovID << " with " << item.sourcePath << '\n';
 	}
 
+	// Overlays are likely to change, so they get growth slack
+	const u32 slack = config.growthSlack(item.size);
+	romCheckBounds(romOffset + item.size + slack);
+
 	if (!clean)
 	{
-		if (size >= 1 << 24)
+		if (item.size >= 1 << 24)
 			throw std::length_error("size of " + finalPath.string() + " exceeds 16 MB");
 
 		// Adjust the compressed size of the overlay in the overlay table
-		u8* p = rom.data() + ovtOffset + 0x20*ovID + 0x1c;
+		u8* p = ovt.data() + 0x20*entry.ovtIndex + 0x1c;
 
-		p[0] = size       & 0xff;
-		p[1] = size >>  8 & 0xff;
-		p[2] = size >> 16 & 0xff;
+		p[0] = item.size       & 0xff;
+		p[1] = item.size >>  8 & 0xff;
+		p[2] = item.size >> 16 & 0xff;
 	}
 
-	entry.start = romOffset;
-	entry.end = romOffset + size;
-	romOffset += size;
+	entry.itemIndex = plan.items.size() - 1;
+	romOffset += item.size + slack;
+}
+
+struct NitroFSFile
+{
+	fs::path path;
+	u16 fileID;
+};
+
+/**
+ * @brief List the files in the FNT tree in the order they are placed in the ROM.
+ */
+static void nfsListFiles(const NDSDirectory& dir, const fs::path& p, std::vector<NitroFSFile>& files)
+{
+	for (u32 i = 0; i < dir.files.size(); i++)
+		files.emplace_back(p / dir.files[i], dir.firstFileID + i);
+
+	for (u32 i = 0; i < dir.dirs.size(); i++)
+		nfsListFiles(dir.dirs[i], p / dir.dirs[i].dirName, files);
 }
 
+/**
+ * @brief Place the NitroFS files in the ROM and link them to the FAT.
+ * 
+ * The input files are looked up on up to `jobs` threads, since that is
+ * mostly waiting for the file system. The layout doesn't depend on it.
+ */
 static void nfsAddAndLink(
-	std::vector<u8>& rom,
-	u32 fatOffset,
-	const NDSDirectory& dir,
-	const fs::path& p,
+	RomPlan& plan,
+	const LayeredFS& sources,
+	const NDSDirectory& rootDir,
 	u32& romOffset,
-	u8 padding
+	const CompressedFiles& compressedFiles,
+	const Config& config,
+	unsigned jobs
 )
 {
-	u16 dirFileID = dir.firstFileID;
+	std::vector<NitroFSFile> files;
+	nfsListFiles(rootDir, "root", files);
 
-	for (u32 i = 0; i < dir.files.size(); i++)
+	std::vector<InputFile> inputFiles(files.size());
+	std::vector<std::uintmax_t> fileSizes(files.size());
+
+	parallelFor(files.size(), jobs, [&](std::size_t i)
+	{
+		if (compressedFiles.contains(files[i].path))
+			return;
+
+		inputFiles[i] = findInputFile(sources, files[i].path);
+		fileSizes[i] = inputFiles[i].size();
+	});
+
+	for (std::size_t i = 0; i < files.size(); i++)
 	{
-		fs::path filePath = findInputFile(p / dir.files[i]);
-		u32 fileSize = fs::file_size(filePath);
+		const fs::path& path = files[i].path;
+		RomItem item;
+		item.name = path.generic_string();
+		item.offset = romOffset;
+		bool modified = true;
 
-		if (fileSize > oneGB)
+		if (!planCompressedFile(item, path, compressedFiles))
 		{
-			std::cout << WARNING "File size of " << filePath << " with " << fileSize << " bytes exceeds 1 GB, skipping\n";
-			dirFileID++;
-			continue;
+			if (fileSizes[i] > oneGB)
+			{
+				std::cout << WARNING "File size of " << inputFiles[i].path << " with " << fileSizes[i] << " bytes exceeds 1 GB, skipping\n";
+				continue;
+			}
+
+			item.size = fileSizes[i];
+			setSource(item, inputFiles[i]);
+			modified = inputFiles[i].layer != sources.layerCount() - 1;
 		}
 
-		romCheckBounds(rom, romOffset + fileSize, padding);
-		readInputFile(filePath, &rom[romOffset], fileSize);
+		// Files from the clean ROM are packed tightly, since they're unlikely to change
+		const u32 slack = modified ? config.growthSlack(item.size) : 0;
 
-		u8* ptr = rom.data() + fatOffset + dirFileID*8;
-		writeU32(ptr, romOffset);
-		writeU32(ptr + 4, romOffset + fileSize);
+		romCheckBounds(romOffset + item.size + slack);
+		item.fileID = files[i].fileID;
 
-		romOffset += fileSize;
+		romOffset += item.size + slack;
 		romOffset = alignAddress(romOffset, 4);
-		dirFileID++;
+
+		plan.items.push_back(std::move(item));
 	}
+}
 
-	for (u32 i = 0; i < dir.dirs.size(); i++)
-		nfsAddAndLink(rom, fatOffset, dir.dirs[i], p / dir.dirs[i].dirName, romOffset, padding);
+static std::vector<u8> readTable(const InputFile& file, u32 size)
+{
+	std::vector<u8> table(size);
+	file.read(table.data(), size);
+
+	return table;
 }
 
-void pack(const fs::path& outputPath)
+/**
+ * @brief Read the overlay table and map the IDs of its overlays to their entries.
+ * 
+ * Overlays marked with the replacement flag get a file ID later.
+ */
+static void readOverlayTable(
+	std::vector<u8>& ovt,
+	const InputFile& ovtFile,
+	const char* name,
+	std::map<u32, OverlayEntry>& entries,
+	u16& freeOvFileID,
+	const Config& config
+)
 {
-	Config config(outputPath);
+	const fs::path& ovtPath = ovtFile.path;
+	const u32 ovtSize = ovtFile.size();
+	checkFileSize(ovtPath, ovtSize, oneGB);
 
-	std::cout << "Building ROM with the following configuration:\n";
-	config.print();
+	if (ovtSize % 0x20)
+	{
+		throw std::length_error(
+			"invalid " + std::string(name) + " overlay table: " + ovtPath.string()
+			+ " (each entry must be 0x20 bytes)"
+		);
+	}
 
-	if (config.romPath.empty())
-		throw std::invalid_argument("no output file given");
+	ovt = readTable(ovtFile, ovtSize);
+
+	for (u32 i = 0; i < ovtSize / 32; i++)
+	{
+		OverlayEntry e = { 0xffff, i, 0 };
+
+		if (ovt[i * 32 + 31] != config.ovtReplFlag)
+		{
+			u16 fid = readU16(&ovt[i * 32 + 24]);
+			freeOvFileID = std::max(freeOvFileID + 0, fid + 1);
+			e.fileID = fid;
+		}
 
+		entries[readU32(&ovt[i * 32])] = e;
+	}
+}
+
+static void assignOverlayFileIDs(
+	std::vector<u8>& ovt,
+	const char* name,
+	std::map<u32, OverlayEntry>& entries,
+	u16& freeFileID,
+	const Config& config
+)
+{
+	for (u32 i = 0; i < ovt.size() / 32; i++)
+	{
+		if (ovt[i * 32 + 31] == config.ovtReplFlag)
+		{
+			u32 ovID = readU32(&ovt[i * 32]);
+			ovt[i * 32 + 24] = freeFileID & 0x00FF;
+			ovt[i * 32 + 25] = (freeFileID & 0xFF00) >> 8;
+			ovt[i * 32 + 26] = 0;
+			ovt[i * 32 + 27] = 0;
+			ovt[i * 32 + 31] = 3;
+			entries[ovID].fileID = freeFileID;
+			std::cout << name << " overlay " << ovID << " obtained file ID " << freeFileID << '\n';
+			freeFileID++;
+		}
+	}
+}
+
+static const RomItem* findItem(const RomPlan& plan, std::string_view name)
+{
+	const auto it = std::ranges::find(plan.items, name, &RomItem::name);
+
+	return it != plan.items.end() ? &*it : nullptr;
+}
+
+/**
+ * @brief Point the FAT entries of the overlays and NitroFS files to where they are placed.
+ */
+static void linkFat(RomPlan& plan)
+{
+	for (const RomItem& item : plan.items)
+	{
+		if (item.fileID < 0)
+			continue;
+
+		if (item.fileID * 8u + 8 > plan.fat.size())
+			throw std::runtime_error("invalid file ID of " + item.name);
+
+		u8* ptr = plan.fat.data() + item.fileID*8;
+		writeU32(ptr, item.offset);
+		writeU32(ptr + 4, item.offset + item.size);
+	}
+}
+
+/**
+ * @brief Write the offsets and sizes of the parts of the ROM to the header,
+ * and update the device capacity and the header checksum.
+ */
+static void fixHeader(RomPlan& plan, const Config& config)
+{
+	u8* header = plan.header.data();
+
+	// Writes the offset and size of an item, or zeros if the ROM doesn't have it
+	auto writeItem = [&](u32 offsetPos, u32 sizePos, std::string_view name)
+	{
+		const RomItem* item = findItem(plan, name);
+
+		writeU32(header + offsetPos, item ? item->offset : 0);
+
+		if (sizePos)
+			writeU32(header + sizePos, item ? item->size : 0);
+	};
+
+	writeItem(0x20, 0x2c, "arm9.bin");
+	writeItem(0x30, 0x3c, "arm7.bin");
+	writeItem(0x40, 0x44, "fnt.bin");
+	writeItem(0x48, 0x4c, "fat.bin");
+	writeItem(0x50, 0x54, "arm9ovt.bin");
+	writeItem(0x58, 0x5c, "arm7ovt.bin");
+	writeItem(0x68, 0, "banner.bin");
+	writeItem(0x80, 0, "rsasig.bin");
+	writeItem(0x1000, 0, "rsasig.bin");
+
+	if (config.arm9Entry != Config::keep) writeU32(header + 0x24, config.arm9Entry);
+	if (config.arm9Load  != Config::keep) writeU32(header + 0x28, config.arm9Load);
+	if (config.arm7Entry != Config::keep) writeU32(header + 0x34, config.arm7Entry);
+	if (config.arm7Load  != Config::keep) writeU32(header + 0x38, config.arm7Load);
+
+	header[20] = std::max(std::bit_width(plan.size - 1) - 17, 0);
+	plan.capacity = 0x20000 << header[20];
+
+	const u16 crc = crc16(header, 0x15e);
+	header[0x15e] = crc & 0xff;
+	header[0x15f] = crc >> 8;
+}
+
+/**
+ * @brief Compute the layout of the ROM: the offset, size and source of everything in it,
+ * as well as the header, the overlay tables, the FNT and the FAT.
+ * 
+ * Apart from the tables, no file is read.
+ */
+static RomPlan planRom(const Config& config, const LayeredFS& sources, const CompressedFiles& compressedFiles, unsigned jobs)
+{
+	RomPlan plan;
 	NDSDirectory rootDir;
 
 	std::map<u32, OverlayEntry> ov7Entries;
@@ -455,86 +1010,70 @@ void pack(const fs::path& outputPath)
 	u16 freeOvFileID = 0;
 	u16 freeFileID = 0;
 
-	const fs::path romHeaderPath = findInputFile("header.bin");
-	const fs::path fntPath       = findInputFile("fnt.bin");
-	const fs::path ovt7Path      = findInputFile("arm7ovt.bin");
-	const fs::path ovt9Path      = findInputFile("arm9ovt.bin");
-	const fs::path arm7Path      = findInputFile("arm7.bin");
-	const fs::path arm9Path      = findInputFile("arm9.bin");
-	const fs::path iconPath      = findInputFile("banner.bin");
-	const fs::path rsaPath       = findInputFile("rsasig.bin");
-
-	const fs::path modifiedFinalPath = fs::path("modified") / "final";
-	fs::create_directories(modifiedFinalPath);
+	const InputFile romHeader = findInputFile(sources, "header.bin");
+	const InputFile fntFile   = findInputFile(sources, "fnt.bin");
+	const InputFile ovt7File  = findInputFile(sources, "arm7ovt.bin");
+	const InputFile ovt9File  = findInputFile(sources, "arm9ovt.bin");
+	const InputFile arm7File  = findInputFile(sources, "arm7.bin");
+	const InputFile arm9File  = findInputFile(sources, "arm9.bin");
+	const InputFile iconFile  = findInputFile(sources, "banner.bin");
+	const InputFile rsaFile   = findInputFile(sources, "rsasig.bin");
+
+	const fs::path& fntPath  = fntFile.path;
+	const fs::path& ovt7Path = ovt7File.path;
+	const fs::path& ovt9Path = ovt9File.path;
+	const fs::path& arm7Path = arm7File.path;
+	const fs::path& iconPath = iconFile.path;
+	const fs::path& rsaPath  = rsaFile.path;
 
 	std::cout << "Reading ROM header\n";
 
-	u32 romHeaderSize = fs::file_size(romHeaderPath);
+	plan.headerSize = romHeader.size();
 
-	if (romHeaderSize != 0x200 && romHeaderSize != 0x4000)
+	if (plan.headerSize != 0x200 && plan.headerSize != 0x4000)
 		throw std::length_error("invalid size of ROM header: must be 0x200 or 0x4000");
 
-	std::vector<u8> rom(0x4000);
-	readInputFile(romHeaderPath, rom.data(), romHeaderSize);
-
-	rom.reserve(readU32(rom.data() + 0x80)*3 >> 1);
+	plan.header.resize(0x4000);
+	romHeader.read(plan.header.data(), plan.headerSize);
 
-	if (romHeaderSize == 0x200)
-		std::fill(rom.data() + 0x200, rom.data() + 0x4000, 0);
+	plan.items.emplace_back("header.bin", 0, 0x4000, romHeader.path, plan.header);
 
 	u32 romOffset = 0x4000;
 
-	std::cout << "Adding ARM9 binary " << arm9Path << '\n';
+	RomItem& arm9 = plan.items.emplace_back("arm9.bin", romOffset);
+
+	if (!planCompressedFile(arm9, "arm9.bin", compressedFiles))
+	{
+		arm9.size = arm9File.size();
+		setSource(arm9, arm9File);
+	}
 
-	u32 arm9Size = fs::file_size(arm9Path);
-	checkFileSize(arm9Path, arm9Size, 0x3bfe00);
+	std::cout << "Adding ARM9 binary " << arm9.sourcePath << '\n';
 
-	romCheckBounds(rom, romOffset + arm9Size, config.padding);
-	readInputFile(arm9Path, &rom[romOffset], arm9Size);
+	checkFileSize(arm9.sourcePath, arm9.size, 0x3bfe00);
+	romCheckBounds(romOffset + arm9.size);
 
-	u32 arm9Offset = romOffset;
-	romOffset += arm9Size;
+	const u32 arm9Size = arm9.size;
+	romOffset += arm9Size + config.growthSlack(arm9Size);
 	romOffset = std::max(0x8000U, romOffset);
 
 	std::cout << "Adding ARM9 overlay table " << ovt9Path << '\n';
 
-	u32 ovt9Size = fs::file_size(ovt9Path);
-	checkFileSize(ovt9Path, ovt9Size, oneGB);
-
-	if (ovt9Size % 0x20)
-	{
-		throw std::length_error(
-			"invalid ARM9 overlay table: " + ovt9Path.string()
-			+ " (each entry must be 0x20 bytes)"
-		);
-	}
+	readOverlayTable(plan.ovt9, ovt9File, "ARM9", ov9Entries, freeOvFileID, config);
+	const u32 ovt9Size = plan.ovt9.size();
 
 	if (ovt9Size)
 		romOffset = alignAddress(romOffset, 16);
 	else
 		romOffset = alignAddress(romOffset, 4);
 
-	romCheckBounds(rom, romOffset + 4, config.padding);
+	romCheckBounds(romOffset + 4);
 	u32 ovt9Offset = romOffset;
 
 	if (ovt9Size)
 	{
-		romCheckBounds(rom, romOffset + ovt9Size, config.padding);
-		readInputFile(ovt9Path, &rom[ovt9Offset], ovt9Size);
-
-		for (u32 i = 0; i < ovt9Size / 32; i++)
-		{
-			OverlayEntry e = { 0, 0, 0xffff };
-
-			if (rom[ovt9Offset + i * 32 + 31] != config.ovtReplFlag)
-			{
-				u16 fid = readU16(&rom[ovt9Offset + i * 32 + 24]);
-				freeOvFileID = std::max(freeOvFileID + 0, fid + 1);
-				e.fileID = fid;
-			}
-
-			ov9Entries[readU32(&rom[ovt9Offset + i * 32])] = e;
-		}
+		romCheckBounds(romOffset + ovt9Size);
+		plan.items.emplace_back("arm9ovt.bin", ovt9Offset, ovt9Size, ovt9Path, plan.ovt9);
 	}
 
 	romOffset += ovt9Size;
@@ -542,61 +1081,38 @@ void pack(const fs::path& outputPath)
 	std::cout << "Adding ARM9 overlay files\n";
 
 	for (auto& e : ov9Entries)
-		writeOverlay(rom, e.first, e.second, "overlay9", romOffset, ovt9Offset, config.padding);
+		planOverlay(plan, sources, e.first, e.second, plan.ovt9, "overlay9", romOffset, compressedFiles, config);
 
 	romOffset = alignAddress(romOffset, 512);
 
 	std::cout << "Adding ARM7 binary " << arm7Path << '\n';
 
-	u32 arm7Size = fs::file_size(arm7Path);
+	u32 arm7Size = arm7File.size();
 	checkFileSize(arm7Path, arm7Size, 0x3bfe00);
+	romCheckBounds(romOffset + arm7Size);
 
-	romCheckBounds(rom, romOffset + arm7Size, config.padding);
-	readInputFile(arm7Path, &rom[romOffset], arm7Size);
+	setSource(plan.items.emplace_back("arm7.bin", romOffset, arm7Size), arm7File);
 
-	u32 arm7Offset = romOffset;
-	romOffset += arm7Size;
+	romOffset += arm7Size + config.growthSlack(arm7Size);
 	romOffset = alignAddress(romOffset, 4);
 
 	std::cout << "Adding ARM7 overlay table " << ovt7Path << '\n';
 
-	u32 ovt7Size = fs::file_size(ovt7Path);
-	checkFileSize(ovt7Path, ovt7Size, oneGB);
-
-	if (ovt7Size % 0x20)
-	{
-		throw std::length_error(
-			"invalid ARM7 overlay table: " + ovt7Path.string()
-			+ " (each entry must be 0x20 bytes)"
-		);
-	}
+	readOverlayTable(plan.ovt7, ovt7File, "ARM7", ov7Entries, freeOvFileID, config);
+	const u32 ovt7Size = plan.ovt7.size();
 
 	if (ovt7Size)
 		romOffset = alignAddress(romOffset, 16);
 	else
 		romOffset = alignAddress(romOffset, 4);
 
-	romCheckBounds(rom, romOffset + 4, config.padding);
+	romCheckBounds(romOffset + 4);
 	u32 ovt7Offset = romOffset;
 
 	if (ovt7Size)
 	{
-		romCheckBounds(rom, romOffset + ovt7Size, config.padding);
-		readInputFile(ovt7Path, &rom[ovt7Offset], ovt7Size);
-
-		for (u32 i = 0; i < ovt7Size / 32; i++)
-		{
-			OverlayEntry e = { 0, 0, 0xffff };
-
-			if (rom[ovt7Offset + i * 32 + 31] != config.ovtReplFlag)
-			{
-				u16 fid = readU16(&rom[ovt7Offset + i * 32 + 24]);
-				freeOvFileID = std::max(freeOvFileID + 0, fid + 1);
-				e.fileID = fid;
-			}
-
-			ov7Entries[readU32(&rom[ovt7Offset + i * 32])] = e;
-		}
+		romCheckBounds(romOffset + ovt7Size);
+		plan.items.emplace_back("arm7ovt.bin", ovt7Offset, ovt7Size, ovt7Path, plan.ovt7);
 	}
 
 	romOffset += ovt7Size;
@@ -604,121 +1120,58 @@ void pack(const fs::path& outputPath)
 	std::cout << "Adding ARM7 overlay files\n";
 
 	for (auto& e : ov7Entries)
-		writeOverlay(rom, e.first, e.second, "overlay7", romOffset, ovt7Offset, config.padding);
+		planOverlay(plan, sources, e.first, e.second, plan.ovt7, "overlay7", romOffset, compressedFiles, config);
 
 	romOffset = alignAddress(romOffset, 4);
 
 	std::cout << "Reading FNT " << fntPath << '\n';
 
-	u32 fntSize = fs::file_size(fntPath);
+	u32 fntSize = fntFile.size();
 	checkFileSize(fntPath, fntSize, oneGB);
 
-	romCheckBounds(rom, romOffset + fntSize, config.padding);
-	readInputFile(fntPath, &rom[romOffset], fntSize);
+	plan.fnt = readTable(fntFile, fntSize);
 
 	std::cout << "Extracting FNT directory tree\n";
 
-	rootDir = buildFntTree(&rom[romOffset], 0xF000, fntSize);
+	rootDir = buildFntTree(plan.fnt.data(), 0xF000, fntSize);
 	freeFileID = std::max(freeOvFileID, fntFindNextFreeFileID(rootDir));
 
 	std::cout << "Assigning file IDs to new overlays\n";
 
-	for (u32 i = 0; i < ovt9Size / 32; i++)
-	{
-		if (rom[ovt9Offset + i * 32 + 31] == config.ovtReplFlag)
-		{
-			u32 ovID = readU32(&rom[ovt9Offset + i * 32]);
-			rom[ovt9Offset + i * 32 + 24] = freeFileID & 0x00FF;
-			rom[ovt9Offset + i * 32 + 25] = (freeFileID & 0xFF00) >> 8;
-			rom[ovt9Offset + i * 32 + 26] = 0;
-			rom[ovt9Offset + i * 32 + 27] = 0;
-			rom[ovt9Offset + i * 32 + 31] = 3;
-			ov9Entries[ovID].fileID = freeFileID;
-			std::cout << "ARM9 overlay " << ovID << " obtained file ID " << freeFileID << '\n';
-			freeFileID++;
-		}
-	}
-
-	const fs::path finalOvt9Path = modifiedFinalPath / "arm9ovt.bin";
-	std::cout << "Writing " << finalOvt9Path << '\n';
-
-	std::ofstream ovt9File(finalOvt9Path, std::ios::binary | std::ios::out);
-
-	if (!ovt9File.is_open())
-		throw std::runtime_error("failed to create file " + finalOvt9Path.string());
-
-	if (!ovt9File.write(reinterpret_cast<const char*>(rom.data() + ovt9Offset), ovt9Size))
-		throw std::runtime_error("failed to write file " + finalOvt9Path.string());
-
-	ovt9File.close();
-
-	for (u32 i = 0; i < ovt7Size / 32; i++)
-	{
-		if (rom[ovt7Offset + i * 32 + 31] == config.ovtReplFlag)
-		{
-			u32 ovID = readU32(&rom[ovt7Offset + i * 32]);
-			rom[ovt7Offset + i * 32 + 24] = freeFileID & 0x00FF;
-			rom[ovt7Offset + i * 32 + 25] = (freeFileID & 0xFF00) >> 8;
-			rom[ovt7Offset + i * 32 + 26] = 0;
-			rom[ovt7Offset + i * 32 + 27] = 0;
-			rom[ovt7Offset + i * 32 + 31] = 3;
-			ov7Entries[ovID].fileID = freeFileID;
-			std::cout << "ARM7 overlay " << ovID << " obtained file ID " << freeFileID << '\n';
-			freeFileID++;
-		}
-	}
-
-	const fs::path finalOvt7Path = modifiedFinalPath / "arm7ovt.bin";
-	std::cout << "Writing " << finalOvt7Path << '\n';
-
-	std::ofstream ovt7File(finalOvt7Path, std::ios::binary | std::ios::out);
-
-	if (!ovt7File.is_open())
-		throw std::runtime_error("failed to create file " + finalOvt7Path.string());
-
-	if (!ovt7File.write(reinterpret_cast<const char*>(rom.data() + ovt7Offset), ovt7Size))
-		throw std::runtime_error("failed to write file " + finalOvt7Path.string());
-
-	ovt7File.close();
+	assignOverlayFileIDs(plan.ovt9, "ARM9", ov9Entries, freeFileID, config);
+	assignOverlayFileIDs(plan.ovt7, "ARM7", ov7Entries, freeFileID, config);
 
 	u16 freeDirID = fntFindNextFreeDirID(rootDir);
+	fs::path fntSourcePath = fntPath;
+
+	// New files can come from modified/base and the layers from the config
+	const u32 newFileLayers = (1u << (sources.layerCount() - 1)) - (1u << baseLayer);
 
-	if (const fs::path rootPath = fs::path("modified") / "base" / "root";
-		fs::is_directory(rootPath)
-		&& fntAddNewFiles(rootDir, rootPath, freeFileID, freeDirID, false))
+	if (fntAddNewFiles(rootDir, sources, "root", newFileLayers, freeFileID, freeDirID, false))
 	{
 		std::cout << "Rebuilding FNT\n";
 
-		fntRebuild(rom, romOffset, rootDir, fntSize, config.padding);
+		fntRebuild(plan.fnt, rootDir);
+		fntSize = plan.fnt.size();
+		fntSourcePath.clear();
 	}
 	else
 		std::cout << "Keeping the original FNT\n";
 
-	u32 fntOffset = romOffset;
+	romCheckBounds(romOffset + fntSize);
+	plan.items.emplace_back("fnt.bin", romOffset, fntSize, fntSourcePath, plan.fnt);
+
 	romOffset += fntSize;
 	romOffset = alignAddress(romOffset, 4);
 
-	const fs::path finalFntPath = modifiedFinalPath / "fnt.bin";
-	std::cout << "Writing " << finalFntPath << '\n';
-
-	// write final fnt file here
-	std::ofstream fntFile(finalFntPath, std::ios::binary | std::ios::out);
-
-	if (!fntFile.is_open())
-		throw std::runtime_error("failed to create file " + finalFntPath.string());
-
-	if (!fntFile.write(reinterpret_cast<const char*>(rom.data() + fntOffset), fntSize))
-		throw std::runtime_error("failed to write file " + finalFntPath.string());
-
-	fntFile.close();
-
 	std::cout << "Allocating FAT\n";
 
 	u32 fatSize = freeFileID * 8;
-	romCheckBounds(rom, romOffset + fatSize, config.padding);
+	romCheckBounds(romOffset + fatSize);
 
 	u32 fatOffset = romOffset;
-	std::memset(&rom[fatOffset], 0x00, fatSize);
+	plan.fat.resize(fatSize);
+	plan.items.emplace_back("fat.bin", fatOffset, fatSize, fs::path(), plan.fat);
 
 	romOffset += fatSize;
 	romOffset = alignAddress(romOffset, 512);
@@ -726,33 +1179,19 @@ void pack(const fs::path& outputPath)
 	std::cout << "Linking overlays to FAT\n";
 
 	for (const auto& ov : ov9Entries)
-	{
-		const OverlayEntry& ov9e = ov.second;
-		u8* fatPtr = rom.data() + fatOffset + ov9e.fileID*8;
-
-		writeU32(fatPtr, ov9e.start);
-		writeU32(fatPtr + 4, ov9e.end);
-	}
+		plan.items[ov.second.itemIndex].fileID = ov.second.fileID;
 
 	for (const auto& ov : ov7Entries)
-	{
-		const OverlayEntry& ov7e = ov.second;
-		u8* fatPtr = rom.data() + fatOffset + ov7e.fileID*8;
-
-		writeU32(fatPtr, ov7e.start);
-		writeU32(fatPtr + 4, ov7e.end);
-	}
+		plan.items[ov.second.itemIndex].fileID = ov.second.fileID;
 
 	std::cout << "Adding icon / title " << iconPath << '\n';
 
-	u32 iconSize = fs::file_size(iconPath);
-	std::ifstream iconFile = openInputFile(iconPath);
+	u32 iconSize = iconFile.size();
 
-	u16 version;
-	if (!iconFile.read(reinterpret_cast<char*>(&version), 2))
-		throw std::runtime_error("failed to read file " + iconPath.string());
+	u8 version[2];
+	iconFile.read(version, 2);
 
-	switch (version)
+	switch (readU16(version))
 	{
 	default:
 		std::cout << WARNING "Invalid icon / title ID, defaulting to 0x840\n";
@@ -775,38 +1214,22 @@ void pack(const fs::path& outputPath)
 		break;
 	}
 
-	iconFile.seekg(-2, std::ios::cur);
-	romCheckBounds(rom, romOffset + iconSize, config.padding);
-
-	if (!iconFile.read(reinterpret_cast<char*>(&rom[romOffset]), iconSize))
+	if (iconFile.size() < iconSize)
 		throw std::runtime_error("failed to read file " + iconPath.string());
 
-	iconFile.close();
+	romCheckBounds(romOffset + iconSize);
+	setSource(plan.items.emplace_back("banner.bin", romOffset, iconSize), iconFile);
 
-	u32 iconOffset = romOffset;
 	romOffset += iconSize;
 	romOffset = alignAddress(romOffset, 512);
 
 	std::cout << "Adding NitroROM filesystem\n";
 
-	nfsAddAndLink(rom, fatOffset, rootDir, "root", romOffset, config.padding);
-
-	const fs::path finalFatPath = modifiedFinalPath / "fat.bin";
-	std::cout << "Writing " << finalFatPath << '\n';
-
-	std::ofstream fatFile(finalFatPath, std::ios::binary | std::ios::out);
-
-	if (!fatFile.is_open())
-		throw std::runtime_error("failed to create file " + finalFatPath.string());
-
-	if (!fatFile.write(reinterpret_cast<const char*>(rom.data() + fatOffset), fatSize))
-		throw std::runtime_error("failed to write file " + finalFatPath.string());
-
-	fatFile.close();
+	nfsAddAndLink(plan, sources, rootDir, romOffset, compressedFiles, config, jobs);
 
 	std::cout << "Adding RSA signature " << rsaPath << '\n';
 
-	u32 rsaSize = fs::file_size(rsaPath);
+	u32 rsaSize = rsaFile.size();
 
 	if (rsaSize != 0x88)
 	{
@@ -817,77 +1240,684 @@ void pack(const fs::path& outputPath)
 		throw std::length_error(s.view().data());
 	}
 
-	romCheckBounds(rom, romOffset + rsaSize, config.padding);
-	readInputFile(rsaPath, &rom[romOffset], rsaSize);
+	romCheckBounds(romOffset + rsaSize);
+	setSource(plan.items.emplace_back("rsasig.bin", romOffset, rsaSize), rsaFile);
+	plan.size = romOffset + rsaSize;
+
+	linkFat(plan);
 
-	std::cout << "Done building ROM\n";
 	std::cout << "Fixing ROM header\n";
 
-	writeU32(rom.data() +   0x20, arm9Offset);
-	writeU32(rom.data() +   0x2c, arm9Size);
-	writeU32(rom.data() +   0x30, arm7Offset);
-	writeU32(rom.data() +   0x3c, arm7Size);
-	writeU32(rom.data() +   0x40, fntOffset);
-	writeU32(rom.data() +   0x44, fntSize);
-	writeU32(rom.data() +   0x48, fatOffset);
-	writeU32(rom.data() +   0x4c, fatSize);
-	writeU32(rom.data() +   0x50, ovt9Size ? ovt9Offset : 0);
-	writeU32(rom.data() +   0x54, ovt9Size);
-	writeU32(rom.data() +   0x58, ovt7Size ? ovt7Offset : 0);
-	writeU32(rom.data() +   0x5c, ovt7Size);
-	writeU32(rom.data() +   0x68, iconOffset);
-	writeU32(rom.data() +   0x80, romOffset);
-	writeU32(rom.data() + 0x1000, romOffset);
-
-	if (config.arm9Entry != Config::keep) writeU32(rom.data() + 0x24, config.arm9Entry);
-	if (config.arm9Load  != Config::keep) writeU32(rom.data() + 0x28, config.arm9Load);
-	if (config.arm7Entry != Config::keep) writeU32(rom.data() + 0x34, config.arm7Entry);
-	if (config.arm7Load  != Config::keep) writeU32(rom.data() + 0x38, config.arm7Load);
-
-	rom[20] = std::max(std::bit_width(rom.size() - 1) - 17, 0);
-
-	std::cout << "ROM device capacity: 0x" << std::hex << (0x20000 << rom[20]);
-	std::cout << " bytes\nUsed ROM space: 0x" << rom.size();
+	fixHeader(plan, config);
+
+	std::cout << "ROM device capacity: 0x" << std::hex << plan.capacity;
+	std::cout << " bytes\nUsed ROM space: 0x" << plan.size;
 	std::cout << " bytes\n" << std::dec;
 
-	const u16 crc = crc16(rom.data(), 0x15e);
-	rom[0x15e] = crc & 0xff;
-	rom[0x15f] = crc >> 8;
+	return plan;
+}
+
+/**
+ * @brief Print the offset, size and source of everything in the ROM.
+ */
+static void printRomMap(const RomPlan& plan)
+{
+	std::cout << "ROM map:\n";
+
+	for (const RomItem& item : plan.items)
+	{
+		std::cout << "0x" << std::hex << std::setfill('0') << std::setw(8) << item.offset
+			<< "  0x" << std::setw(8) << item.size << std::dec << std::setfill(' ')
+			<< "  " << item.name << "  ";
+
+		if (item.sourcePath.empty())
+			std::cout << "(generated)";
+		else
+			std::cout << item.sourcePath;
+
+		if (item.uncompressed)
+			std::cout << " (not compressed yet, uncompressed size)";
 
-	const fs::path finalRomHeaderPath = modifiedFinalPath / "header.bin";
-	std::cout << "Writing " << finalRomHeaderPath << '\n';
+		std::cout << '\n';
+	}
+}
 
-	std::ofstream headerFile(finalRomHeaderPath, std::ios::binary | std::ios::out);
+static void writeOutputFile(const fs::path& path, std::span<const u8> data)
+{
+	// An identical file is kept, so that its modification time doesn't change the input fingerprint
+	if (fileExistsAndEquals(path, data.data(), data.size()))
+		return;
 
-	if (!headerFile.is_open())
-		throw std::runtime_error("failed to create file " + finalRomHeaderPath.string());
+	std::cout << "Writing " << path << '\n';
 
-	if (!headerFile.write(reinterpret_cast<const char*>(rom.data()), romHeaderSize))
-		throw std::runtime_error("failed to write file " + finalRomHeaderPath.string());
+	std::ofstream file(path, std::ios::binary | std::ios::out);
 
-	headerFile.close();
+	if (!file.is_open())
+		throw std::runtime_error("failed to create file " + path.string());
 
-	std::cout << "Writing " << config.romPath << '\n';
+	if (!file.write(reinterpret_cast<const char*>(data.data()), data.size()))
+		throw std::runtime_error("failed to write file " + path.string());
+}
+
+static void writeTables(const RomPlan& plan)
+{
+	fs::create_directories(modifiedFinalPath);
+
+	writeOutputFile(modifiedFinalPath / "arm9ovt.bin", plan.ovt9);
+	writeOutputFile(modifiedFinalPath / "arm7ovt.bin", plan.ovt7);
+	writeOutputFile(modifiedFinalPath / "fnt.bin", plan.fnt);
+	writeOutputFile(modifiedFinalPath / "fat.bin", plan.fat);
+	writeOutputFile(modifiedFinalPath / "header.bin", std::span(plan.header).first(plan.headerSize));
+}
+
+/**
+ * @brief Get the paths of the files that writeTables writes.
+ */
+static std::vector<fs::path> tablePaths()
+{
+	std::vector<fs::path> paths;
+
+	for (const char* name : {"arm9ovt.bin", "arm7ovt.bin", "fnt.bin", "fat.bin", "header.bin"})
+		paths.push_back(modifiedFinalPath / name);
+
+	return paths;
+}
+
+/**
+ * @brief Get where the record of the last build of the output ROM is kept.
+ */
+static fs::path recordPath(const Config& config)
+{
+	const std::string romPath = fs::absolute(config.romPath).lexically_normal().generic_string();
+
+	std::stringstream s;
+	s << std::hex << std::setfill('0') << std::setw(16) << hash64(romPath.data(), romPath.size());
+
+	return config.cachePath / "builds" / s.str();
+}
+
+/**
+ * @brief The state of everything in the source directories, by path.
+ */
+using InputState = std::map<std::string, FileState>;
+
+/**
+ * @brief Get the path, size and modification time of everything in the source directories.
+ * 
+ * No file is read, and each one only takes a single stat.
+ */
+static InputState inputState(const Config& config)
+{
+	InputState state;
+
+	for (const fs::path& dir : sourceDirs(config, fs::is_regular_file(mappedCleanRomPath)))
+	{
+		const FileState dirState = fileState(dir);
+
+		// The mapped clean ROM is a single file
+		if (dirState.exists && !dirState.isDirectory)
+			state.emplace(dir.generic_string(), dirState);
+		else if (dirState.isDirectory)
+		{
+			// The same files as in the index of the layers
+			for (const fs::directory_entry& entry
+				: fs::recursive_directory_iterator(dir, fs::directory_options::follow_directory_symlink))
+			{
+				state.emplace(entry.path().generic_string(), fileState(entry.path()));
+			}
+		}
+	}
+
+	return state;
+}
+
+/**
+ * @brief Hash everything that the build depends on: the version of neondst, the
+ * configuration and the state of the source directories.
+ */
+static u64 inputFingerprint(const Config& config, const InputState& state)
+{
+	// A new version may build a different ROM from the same inputs
+	std::ostringstream s;
+	s << neondstVersion << '\0' << config.serialize() << '\0';
+
+	for (const auto& [path, file] : state)
+	{
+		s << path << '\0';
+
+		if (file.isDirectory)
+			s << "dir";
+		else
+			s << file.size << ' ' << file.time;
+
+		s << '\0';
+	}
+
+	const std::string data = s.str();
+
+	return hash64(data.data(), data.size());
+}
+
+/**
+ * @brief Get the fingerprint of the inputs of a build that just finished.
+ * 
+ * The build writes tables and compressed files to modified/final, which is a source
+ * directory too. If those are the only changes since `before` was taken, the inputs
+ * as they are now are fingerprinted, so that the next build is up to date right away.
+ * Otherwise, something else changed while the build ran, and the fingerprint of `before`
+ * makes the next build look at the inputs again.
+ * 
+ * @param before The state of the inputs before the build read them.
+ * @param outputs The files that the build wrote to modified/final.
+ */
+static u64 builtInputFingerprint(const Config& config, const InputState& before, const std::vector<fs::path>& outputs)
+{
+	const InputState after = inputState(config);
+
+	// The outputs, and the directories created for them
+	std::unordered_set<std::string> ownChanges;
+
+	for (const fs::path& output : outputs)
+		for (fs::path path = output; !path.empty(); path = path.parent_path())
+			ownChanges.insert(path.generic_string());
+
+	auto changedByOthers = [&](const InputState& a, const InputState& b)
+	{
+		return std::ranges::any_of(a, [&](const auto& entry)
+		{
+			const auto it = b.find(entry.first);
+
+			return (it == b.end() || it->second != entry.second) && !ownChanges.contains(entry.first);
+		});
+	};
+
+	if (changedByOthers(before, after) || changedByOthers(after, before))
+		return inputFingerprint(config, before);
+
+	return inputFingerprint(config, after);
+}
+
+/**
+ * @brief Describe the contents of an item for the build record.
+ * 
+ * Items copied from a file are identified by the file and its modification time,
+ * so that the file doesn't have to be read. Since the mapped clean ROM doesn't
+ * change, the same goes for its files. Everything else is hashed.
+ */
+static BuildRecord::Item recordItem(const RomItem& item)
+{
+	BuildRecord::Item result;
+	result.name = item.name;
+	result.offset = item.offset;
+	result.size = item.size;
+
+	if (item.mapped || item.data.empty())
+		result.source = item.sourcePath;
+
+	if (result.source.empty())
+		result.hash = hash64(item.data.data(), item.data.size());
+	else
+		result.sourceTime = fileTime(item.mapped ? mappedCleanRomPath : item.sourcePath);
+
+	return result;
+}
+
+/**
+ * @brief Check whether an item still has the contents it had in the last build.
+ * 
+ * If the source file of the item was modified, it is hashed and the hash is
+ * stored in `item`, so that touching a file doesn't cause it to be written again.
+ * 
+ * @param oldRom The output ROM of the last build, to compare the file with if the
+ * last build didn't hash it.
+ */
+static bool sameContents(BuildRecord::Item& item, const BuildRecord::Item& oldItem, std::span<const u8> oldRom)
+{
+	if (item.size != oldItem.size || item.source != oldItem.source)
+		return false;
+
+	if (item.source.empty())
+		return item.hash == oldItem.hash;
+
+	if (item.sourceTime == oldItem.sourceTime)
+	{
+		item.hash = oldItem.hash;
+		return true;
+	}
+
+	// Files of the mapped clean ROM are only identified by the time of the ROM
+	if (!fs::is_regular_file(item.source))
+		return false;
+
+	const MappedFile file(item.source);
+
+	if (file.data().size() < item.size)
+		return false;
+
+	const std::span<const u8> contents = file.data().first(item.size);
+	item.hash = hash64(contents.data(), contents.size());
+
+	if (oldItem.hash)
+		return item.hash == oldItem.hash;
+
+	return oldItem.offset + u64(item.size) <= oldRom.size()
+		&& std::ranges::equal(contents, oldRom.subspan(oldItem.offset, item.size));
+}
+
+/**
+ * @brief Load the record of the last build, if it still describes the output ROM.
+ * 
+ * @param reason Receives why there is no usable record.
+ */
+static std::optional<BuildRecord> loadRecord(const Config& config, const char*& reason)
+{
+	std::optional<BuildRecord> record = BuildRecord::load(recordPath(config));
+
+	if (!record)
+	{
+		reason = "no record of the last build";
+		return std::nullopt;
+	}
+
+	std::error_code ec;
+	const std::uintmax_t romSize = fs::file_size(config.romPath, ec);
+
+	if (ec || romSize != record->romSize || fileTime(config.romPath) != record->romTime)
+	{
+		reason = "the ROM was changed since the last build";
+		return std::nullopt;
+	}
+
+	if (record->padding != config.padding)
+	{
+		reason = "the padding was changed";
+		return std::nullopt;
+	}
+
+	return record;
+}
+
+/**
+ * @brief Check whether the plan has the same items with the same offsets and sizes as the record.
+ */
+static bool sameLayout(const RomPlan& plan, const BuildRecord& record)
+{
+	return std::ranges::equal(plan.items, record.items, [](const RomItem& item, const BuildRecord::Item& oldItem)
+	{
+		return item.name == oldItem.name && item.offset == oldItem.offset && item.size == oldItem.size;
+	});
+}
+
+/**
+ * @brief Check which items changed since the last build. The plan has to have
+ * the same items as the record, apart from their contents.
+ * 
+ * @param newItems Receives the record of each item.
+ * @param oldRom The output ROM of the last build.
+ * 
+ * @return For each item, whether its contents changed.
+ */
+static std::vector<u8> findChangedItems(
+	const RomPlan& plan,
+	const BuildRecord& record,
+	std::span<const u8> oldRom,
+	std::vector<BuildRecord::Item>& newItems,
+	unsigned jobs
+)
+{
+	std::vector<u8> changed(plan.items.size());
+	newItems.resize(plan.items.size());
+
+	parallelFor(plan.items.size(), jobs, [&](std::size_t i)
+	{
+		newItems[i] = recordItem(plan.items[i]);
+		changed[i] = !sameContents(newItems[i], record.items[i], oldRom);
+	});
+
+	return changed;
+}
+
+/**
+ * @brief A range of items that is copied as a whole from the output ROM of the last build.
+ */
+struct ReusedBlock
+{
+	std::size_t first = 0; ///< the index of the first item
+	std::size_t end = 0;   ///< the index after the last item
+	u32 sourceOffset = 0;  ///< the offset of the block in the last ROM
+	u32 size = 0;
+};
+
+/**
+ * @brief Check whether the NitroFS files can be copied from the output ROM of
+ * the last build in one piece, along with the padding between them.
+ * 
+ * That is the case if the ROM has the same files with the same contents, in the
+ * same order. They then have the same offsets relative to each other, so only
+ * the start of the block may move, e.g. when arm9.bin or an overlay changed size.
+ */
+static std::optional<ReusedBlock> findReusableNitroFS(
+	const RomPlan& plan,
+	const BuildRecord& record,
+	std::span<const u8> oldRom,
+	unsigned jobs
+)
+{
+	auto isNitroFSItem = [](const auto& item) { return item.name.starts_with("root/"); };
+
+	const auto first = std::ranges::find_if(plan.items, isNitroFSItem);
+	const auto oldFirst = std::ranges::find_if(record.items, isNitroFSItem);
+	const auto oldEnd = std::find_if_not(oldFirst, record.items.end(), isNitroFSItem);
+
+	ReusedBlock block;
+	block.first = first - plan.items.begin();
+	block.end = std::find_if_not(first, plan.items.end(), isNitroFSItem) - plan.items.begin();
+
+	const std::size_t oldFirstIndex = oldFirst - record.items.begin();
+	const std::size_t count = block.end - block.first;
+
+	if (count == 0 || static_cast<std::size_t>(oldEnd - oldFirst) != count)
+		return std::nullopt;
+
+	const u32 start = plan.items[block.first].offset;
+	block.sourceOffset = oldFirst->offset;
+
+	std::vector<u8> reusable(count);
+
+	parallelFor(count, jobs, [&](std::size_t i)
+	{
+		const RomItem& item = plan.items[block.first + i];
+		const BuildRecord::Item& oldItem = record.items[oldFirstIndex + i];
+		BuildRecord::Item newItem = recordItem(item);
+
+		reusable[i] = item.name == oldItem.name
+			&& item.offset - start == oldItem.offset - block.sourceOffset
+			&& sameContents(newItem, oldItem, oldRom);
+	});
+
+	if (std::ranges::count(reusable, 0))
+		return std::nullopt;
+
+	const RomItem& last = plan.items[block.end - 1];
+	block.size = last.offset + last.size - start;
 
-	std::ofstream romFile(config.romPath, std::ios::binary | std::ios::out);
+	return block;
+}
+
+/**
+ * @brief Write the ROM and the tables in modified/final as planned.
+ * 
+ * The items are written on up to `jobs` threads. Each one has its own range
+ * in the ROM, so the output doesn't depend on the order.
+ * 
+ * @return The record of the build, without the fingerprint of the inputs.
+ */
+static BuildRecord emitRom(const RomPlan& plan, const Config& config, unsigned jobs)
+{
+	writeTables(plan);
+
+	const char* reason;
+	const std::optional<BuildRecord> record = loadRecord(config, reason);
+
+	const u8 padding = config.padding;
+	const u64 romSize = config.padding != Config::noPadding ? plan.capacity : plan.size;
+
+	// The last ROM is only mapped until the new one replaces it
+	std::optional<MappedFile> oldRom;
+
+	if (record)
+		oldRom.emplace(config.romPath);
+
+	// If the ROM would be the same as the last one, it isn't written again, so that its time stays the same
+	if (record && record->romSize == romSize && sameLayout(plan, *record))
+	{
+		std::vector<BuildRecord::Item> newItems;
+
+		if (std::ranges::count(findChangedItems(plan, *record, oldRom->data(), newItems, jobs), 1) == 0)
+		{
+			std::cout << "The contents of " << config.romPath << " didn't change, keeping it\n";
+
+			BuildRecord newRecord = *record;
+			newRecord.items = std::move(newItems);
+
+			return newRecord;
+		}
+	}
+
+	const std::optional<ReusedBlock> reusedBlock = record
+		? findReusableNitroFS(plan, *record, oldRom->data(), jobs)
+		: std::nullopt;
 
-	if (!romFile.is_open())
-		throw std::runtime_error("failed to create file " + config.romPath.string());
+	oldRom.reset();
 
-	if (!romFile.write(reinterpret_cast<const char*>(rom.data()), rom.size()))
-		throw std::runtime_error("failed to write file " + config.romPath.string());
+	std::cout << "Writing " << config.romPath << '\n';
+
+	if (reusedBlock)
+		std::cout << "Reusing the NitroFS files from the last build of " << config.romPath << '\n';
 
-	if (config.padding != Config::noPadding)
+	// Everything goes straight to the file at its planned offset, so the ROM is never held in memory
+	FileWriter romFile(config.romPath);
+	romFile.resize(romSize);
+
+	parallelFor(plan.items.size(), jobs, [&](std::size_t i)
 	{
-		const auto size = (0x20000 << rom[20]) - rom.size();
-		rom.clear();
-		rom.resize(size, config.padding);
+		const RomItem& item = plan.items[i];
+		const u64 gapStart = i ? plan.items[i - 1].offset + plan.items[i - 1].size : 0;
+		const bool reused = reusedBlock && i >= reusedBlock->first && i < reusedBlock->end;
+
+		// The gaps between the items are filled with the padding byte, except in the reused block
+		if (item.offset > gapStart && !(reused && i > reusedBlock->first))
+			romFile.fill(gapStart, item.offset - gapStart, padding);
 
-		if (!romFile.write(reinterpret_cast<const char*>(rom.data()), rom.size()))
-			throw std::runtime_error("failed to write file " + config.romPath.string());
+		if (reused)
+			return;
+
+		if (!item.data.empty())
+			romFile.write(item.offset, item.data);
+		else if (item.size)
+			romFile.copy(item.offset, item.sourcePath, item.size);
+	});
+
+	if (reusedBlock)
+	{
+		// One copy within the kernel instead of one for every file
+		const u32 offset = plan.items[reusedBlock->first].offset;
+		romFile.copy(offset, config.romPath, reusedBlock->sourceOffset, reusedBlock->size);
 	}
 
-	romFile.close();
+	// After resize, the rest of the file is already zero
+	if (padding != 0)
+		romFile.fill(plan.size, romSize - plan.size, padding);
+
+	romFile.commit();
 
 	std::cout << "Successfully written NDS image " << config.romPath << '\n';
+
+	BuildRecord newRecord;
+	newRecord.romSize = romSize;
+	newRecord.romTime = fileTime(config.romPath);
+	newRecord.padding = config.padding;
+	newRecord.items.resize(plan.items.size());
+
+	parallelFor(plan.items.size(), jobs, [&](std::size_t i)
+	{
+		newRecord.items[i] = recordItem(plan.items[i]);
+	});
+
+	return newRecord;
+}
+
+/**
+ * @brief Patch the output ROM of the last build in place, keeping its layout.
+ * 
+ * This is only possible if the ROM still is the one that the last build wrote,
+ * and if the ROM has the same items in the same order, each of which fits in the
+ * space from its previous offset to that of the next item. The plan is then
+ * changed to the previous layout, and only the items whose contents changed are
+ * written, along with the FAT, the overlay tables and the header if they changed.
+ * 
+ * @return The record of the build, without the fingerprint of the inputs, or std::nullopt
+ * if the ROM wasn't patched. Then the plan is unchanged and the ROM has to be written from scratch.
+ */
+static std::optional<BuildRecord> patchRom(RomPlan& plan, const Config& config, unsigned jobs)
+{
+	auto fullBuild = [](const char* reason)
+	{
+		std::cout << "Writing the whole ROM: " << reason << '\n';
+		return std::nullopt;
+	};
+
+	const char* reason;
+	const std::optional<BuildRecord> record = loadRecord(config, reason);
+
+	if (!record)
+		return fullBuild(reason);
+
+	const std::vector<BuildRecord::Item>& oldItems = record->items;
+
+	if (oldItems.size() != plan.items.size())
+		return fullBuild("files were added or removed");
+
+	for (std::size_t i = 0; i < oldItems.size(); i++)
+	{
+		const u32 slotEnd = i + 1 < oldItems.size() ? oldItems[i + 1].offset : oldItems[i].offset + oldItems[i].size;
+
+		if (oldItems[i].name != plan.items[i].name)
+			return fullBuild("files were added or removed");
+
+		if (plan.items[i].size > slotEnd - oldItems[i].offset)
+			return fullBuild((plan.items[i].name + " doesn't fit in its previous place").c_str());
+	}
+
+	for (std::size_t i = 0; i < oldItems.size(); i++)
+		plan.items[i].offset = oldItems[i].offset;
+
+	plan.size = oldItems.back().offset + oldItems.back().size;
+	linkFat(plan);
+	fixHeader(plan, config);
+
+	writeTables(plan);
+
+	// Only the items whose contents changed are written
+	std::vector<BuildRecord::Item> newItems;
+	const std::vector<u8> changed = findChangedItems(plan, *record, MappedFile(config.romPath).data(), newItems, jobs);
+	const std::size_t changedCount = std::ranges::count(changed, 1);
+
+	BuildRecord newRecord = *record;
+	newRecord.items = std::move(newItems);
+
+	if (changedCount == 0)
+	{
+		std::cout << "The contents of " << config.romPath << " didn't change, keeping it\n";
+		return newRecord;
+	}
+
+	std::cout << "Patching " << changedCount << " of " << oldItems.size() << " items in " << config.romPath << '\n';
+
+	// If the patch is interrupted, the record no longer matches the ROM
+	std::error_code ec;
+	fs::remove(recordPath(config), ec);
+
+	FileWriter romFile(config.romPath, FileWriter::Mode::patch);
+	const u8 padding = config.padding;
+
+	parallelFor(oldItems.size(), jobs, [&](std::size_t i)
+	{
+		if (!changed[i])
+			return;
+
+		const RomItem& item = plan.items[i];
+
+		if (!item.data.empty())
+			romFile.write(item.offset, item.data);
+		else if (item.size)
+			romFile.copy(item.offset, item.sourcePath, item.size);
+
+		// The space that the item no longer uses becomes padding
+		if (oldItems[i].size > item.size)
+			romFile.fill(item.offset + item.size, oldItems[i].size - item.size, padding);
+	});
+
+	romFile.commit();
+
+	std::cout << "Successfully patched NDS image " << config.romPath << '\n';
+
+	newRecord.romTime = fileTime(config.romPath);
+
+	return newRecord;
+}
+
+void pack(const fs::path& outputPath, const BuildOptions& options)
+{
+	Config config(outputPath);
+
+	// Growth slack is only for development builds
+	if (options.release)
+	{
+		config.slackPercent = 0;
+		config.slackAlign = 0;
+	}
+
+	std::cout << "Building ROM with the following configuration:\n";
+	config.print();
+
+	if (config.romPath.empty())
+		throw std::invalid_argument("no output file given");
+
+	// Taken before anything is read, so that files changed during the build are built again next time
+	const InputState inputs = options.dryRun ? InputState() : inputState(config);
+
+	// Nothing is read if the inputs are exactly as they were after the last build
+	if (!options.dryRun)
+	{
+		const char* reason;
+		const std::optional<BuildRecord> record = loadRecord(config, reason);
+
+		if (record && record->inputs == inputFingerprint(config, inputs))
+		{
+			std::cout << config.romPath << " is up to date\n";
+			return;
+		}
+	}
+
+	// For a project created with `init --mapped`, this has to outlive the plan
+	const std::unique_ptr<MappedRom> cleanRom = MappedRom::open();
+	const LayeredFS sources = indexSources(config, cleanRom.get());
+	std::vector<fs::path> staleFiles;
+
+	if (needsCompression(sources, "arm9.bin"))
+		staleFiles.push_back("arm9.bin");
+
+	findStaleOverlays(sources, staleFiles, findInputFile(sources, "arm9ovt.bin"), "overlay9");
+	findStaleOverlays(sources, staleFiles, findInputFile(sources, "arm7ovt.bin"), "overlay7");
+	findStaleNitroFSFiles(sources, staleFiles, config);
+
+	// A dry run only plans the ROM, so nothing is compressed or written
+	const CompressedFiles compressedFiles = options.dryRun
+		? pendingFiles(staleFiles)
+		: compressFiles(staleFiles, config, arm9LoadAddress(sources, config), options.jobs);
+
+	RomPlan plan = planRom(config, sources, compressedFiles, options.jobs);
+
+	if (options.dryRun)
+	{
+		printRomMap(plan);
+		return;
+	}
+
+	std::optional<BuildRecord> record;
+
+	if (options.incremental)
+		record = patchRom(plan, config, options.jobs);
+
+	if (!record)
+		record = emitRom(plan, config, options.jobs);
+
+	std::vector<fs::path> outputs = tablePaths();
+
+	for (const auto& [path, file] : compressedFiles)
+		outputs.push_back(modifiedFinalPath / path);
+
+	record->inputs = builtInputFingerprint(config, inputs, outputs);
+	record->save(recordPath(config));
 }
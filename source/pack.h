@@ -0,0 +1,13 @@
+#pragma once
+
+#include "common.h"
+
+struct BuildOptions
+{
+	unsigned jobs = 1;
+	bool dryRun = false;      ///< only print the ROM map
+	bool incremental = false; ///< patch the output ROM of the last build in place if possible
+	bool release = false;     ///< pack the ROM tightly, without growth slack
+};
+
+void pack(const fs::path& outputPath, const BuildOptions& options);
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Get the default number of threads for parallel work.
+ */
+inline unsigned defaultJobCount()
+{
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+/**
+ * @brief Parse the argument of a -j / --jobs option.
+ * 
+ * @throw std::invalid_argument if the argument isn't a positive integer.
+ */
+inline unsigned parseJobCount(std::string_view arg)
+{
+	unsigned jobs = 0;
+	const auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(), jobs);
+
+	if (error != std::errc{} || end != arg.data() + arg.size() || jobs == 0)
+		throw std::invalid_argument("invalid number of jobs: " + std::string(arg));
+
+	return jobs;
+}
+
+/**
+ * @brief Call a function for every index in [0, count) using up to `jobs` threads.
+ * 
+ * The indices are handed out in increasing order. If the function throws, the
+ * remaining indices are skipped and the first exception is rethrown once all
+ * threads have finished.
+ * 
+ * @param count The number of indices.
+ * @param jobs The maximum number of threads, including the calling thread.
+ * @param func The function to call with each index.
+ */
+template<class Func>
+void parallelFor(std::size_t count, unsigned jobs, Func&& func)
+{
+	if (jobs <= 1 || count <= 1)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			func(i);
+
+		return;
+	}
+
+	std::atomic<std::size_t> next = 0;
+	std::exception_ptr exception;
+	std::mutex exceptionMutex;
+
+	auto worker = [&]
+	{
+		for (std::size_t i; (i = next++) < count;)
+		{
+			try
+			{
+				func(i);
+			}
+			catch (...)
+			{
+				next = count;
+
+				std::lock_guard lock(exceptionMutex);
+				if (!exception) exception = std::current_exception();
+			}
+		}
+	};
+
+	const std::size_t threadCount = std::min<std::size_t>(jobs, count) - 1;
+	std::vector<std::thread> threads;
+	threads.reserve(threadCount);
+
+	while (threads.size() < threadCount)
+		threads.emplace_back(worker);
+
+	worker();
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	if (exception)
+		std::rethrow_exception(exception);
+}
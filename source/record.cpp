@@ -0,0 +1,156 @@
+#include "record.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <charconv>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+// The first line of a record; records of other versions are ignored
+static constexpr std::string_view recordVersion = "neondst build record 2";
+
+s64 fileTime(const fs::path& path)
+{
+	std::error_code ec;
+	const auto time = fs::last_write_time(path, ec);
+
+	return ec ? 0 : time.time_since_epoch().count();
+}
+
+FileState fileState(const fs::path& path)
+{
+	FileState state;
+
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+
+	if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data))
+		return state;
+
+	state.isDirectory = data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+	state.size = static_cast<u64>(data.nFileSizeHigh) << 32 | data.nFileSizeLow;
+	state.time = static_cast<s64>(data.ftLastWriteTime.dwHighDateTime) << 32 | data.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat st;
+
+	if (::stat(path.c_str(), &st) != 0)
+		return state;
+
+	state.isDirectory = S_ISDIR(st.st_mode);
+	state.size = st.st_size;
+	state.time = static_cast<s64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+
+	state.exists = true;
+
+	// Only the presence of a directory matters, not its times
+	if (state.isDirectory)
+	{
+		state.size = 0;
+		state.time = 0;
+	}
+
+	return state;
+}
+
+std::optional<BuildRecord> BuildRecord::load(const fs::path& path)
+{
+	std::ifstream file(path);
+
+	if (!file.is_open())
+		return std::nullopt;
+
+	std::string line;
+
+	if (!std::getline(file, line) || line != recordVersion)
+		return std::nullopt;
+
+	BuildRecord record;
+
+	if (!(file >> record.romSize >> record.romTime >> record.padding >> std::hex >> record.inputs >> std::dec)
+		|| !std::getline(file, line))
+		return std::nullopt;
+
+	// offset, size, hash (or '-'), source time, source path (or '-') and name, separated by tabs
+	while (std::getline(file, line))
+	{
+		std::istringstream s(line);
+		Item& item = record.items.emplace_back();
+		std::string hash, source;
+
+		if (!(s >> item.offset >> item.size >> hash >> item.sourceTime).ignore()
+			|| !std::getline(s, source, '\t')
+			|| !std::getline(s, item.name))
+		{
+			return std::nullopt;
+		}
+
+		if (hash != "-")
+		{
+			u64 value;
+			const auto [end, ec] = std::from_chars(hash.data(), hash.data() + hash.size(), value, 16);
+
+			if (ec != std::errc() || end != hash.data() + hash.size())
+				return std::nullopt;
+
+			item.hash = value;
+		}
+
+		if (source != "-")
+			item.source = source;
+	}
+
+	return record;
+}
+
+void BuildRecord::save(const fs::path& path) const
+{
+	std::error_code ec;
+	fs::create_directories(path.parent_path(), ec);
+
+	if (ec) return;
+
+	fs::path tempPath = path;
+	tempPath += '.' + std::to_string(std::random_device{}()) + ".tmp";
+
+	{
+		std::ofstream file(tempPath);
+
+		if (!file.is_open())
+			return;
+
+		file << recordVersion << '\n' << romSize << ' ' << romTime << ' ' << padding << ' '
+			<< std::hex << inputs << std::dec << '\n';
+
+		for (const Item& item : items)
+		{
+			file << item.offset << '\t' << item.size << '\t';
+
+			if (item.hash)
+				file << std::hex << *item.hash << std::dec;
+			else
+				file << '-';
+
+			file << '\t' << item.sourceTime << '\t'
+				<< (item.source.empty() ? "-" : item.source.generic_string()) << '\t'
+				<< item.name << '\n';
+		}
+
+		if (!file.flush())
+		{
+			file.close();
+			fs::remove(tempPath, ec);
+			return;
+		}
+	}
+
+	fs::rename(tempPath, path, ec);
+
+	if (ec)
+		fs::remove(tempPath, ec);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief What the last build wrote to an output ROM, so that the next
+ * build can patch the ROM in place instead of rewriting it.
+ *
+ * Each item is identified by the contents it had, either as a hash of
+ * the data or, for items copied from a file, by the path and modification
+ * time of the file. The hash of a file is only known once it was read.
+ */
+struct BuildRecord
+{
+	struct Item
+	{
+		std::string name;        ///< e.g. "arm9.bin", "fat.bin" or "root/data/a.bin"
+		u32 offset = 0;
+		u32 size = 0;
+		std::optional<u64> hash; ///< of the contents, if known
+		fs::path source;         ///< the file the contents came from, or empty if they were generated
+		s64 sourceTime = 0;      ///< the modification time of the source file
+	};
+
+	u64 romSize = 0;
+	s64 romTime = 0;  ///< the modification time of the ROM after it was written
+	s16 padding = 0;
+	u64 inputs = 0;   ///< a fingerprint of everything that the build depended on
+	std::vector<Item> items; ///< sorted by offset
+
+	/**
+	 * @brief Load a record.
+	 *
+	 * @return The record, or std::nullopt if it doesn't exist or can't be parsed.
+	 */
+	static std::optional<BuildRecord> load(const fs::path& path);
+
+	/**
+	 * @brief Store the record, replacing the file atomically. Failures are ignored,
+	 * which only means that the next incremental build writes the whole ROM.
+	 */
+	void save(const fs::path& path) const;
+};
+
+/**
+ * @brief What a file looks like from the outside, without reading it.
+ */
+struct FileState
+{
+	bool exists = false;
+	bool isDirectory = false;
+	u64 size = 0;
+	s64 time = 0; ///< the modification time, in units that depend on the platform
+
+	bool operator==(const FileState&) const = default;
+};
+
+/**
+ * @brief Get the type, size and modification time of a file with a single system call,
+ * where fs::directory_entry would take one for each. Symlinks are followed.
+ */
+FileState fileState(const fs::path& path);
+
+/**
+ * @brief Get the modification time of a file as a number that can be stored.
+ *
+ * @return The time, or 0 if the file doesn't exist.
+ */
+s64 fileTime(const fs::path& path);
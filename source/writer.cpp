@@ -0,0 +1,285 @@
+#include "writer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+// The most memory used for fill and copy
+static constexpr std::size_t chunkSize = 1 << 20;
+
+FileWriter::FileWriter(const fs::path& path, Mode mode):
+	path(path)
+{
+	if (mode == Mode::replace)
+	{
+		tempPath = path;
+		tempPath += '.' + std::to_string(std::random_device{}()) + ".tmp";
+	}
+
+	const fs::path& openPath = mode == Mode::replace ? tempPath : path;
+
+#ifdef _WIN32
+	const DWORD disposition = mode == Mode::replace ? CREATE_ALWAYS : OPEN_EXISTING;
+	handle = CreateFileW(openPath.c_str(), GENERIC_WRITE, 0, nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		throw std::runtime_error((mode == Mode::replace ? "failed to create file " : "failed to open file ") + path.string());
+#else
+	if (mode == Mode::replace)
+		fd = open(openPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	else
+		fd = open(openPath.c_str(), O_WRONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		throw std::runtime_error((mode == Mode::replace ? "failed to create file " : "failed to open file ") + path.string());
+
+	struct stat status;
+
+	if (fstat(fd, &status) == 0)
+		blockSize = status.st_blksize;
+#endif
+}
+
+FileWriter::~FileWriter()
+{
+#ifdef _WIN32
+	if (handle == INVALID_HANDLE_VALUE)
+		return;
+
+	CloseHandle(handle);
+#else
+	if (fd < 0)
+		return;
+
+	close(fd);
+#endif
+
+	std::error_code ec;
+
+	if (!tempPath.empty())
+		fs::remove(tempPath, ec);
+}
+
+void FileWriter::resize(u64 size)
+{
+#ifdef _WIN32
+	LARGE_INTEGER end;
+	end.QuadPart = size;
+
+	if (!SetFilePointerEx(handle, end, nullptr, FILE_BEGIN) || !SetEndOfFile(handle))
+		throw std::runtime_error("failed to write file " + path.string());
+#else
+	if (ftruncate(fd, size) != 0)
+		throw std::runtime_error("failed to write file " + path.string());
+
+#ifdef __linux__
+	// Allocating all blocks at once avoids fragmentation; it's fine if the file system can't
+	fallocate(fd, 0, 0, size);
+#endif
+#endif
+}
+
+void FileWriter::write(u64 offset, std::span<const u8> data)
+{
+	while (!data.empty())
+	{
+#ifdef _WIN32
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = offset & 0xffffffff;
+		overlapped.OffsetHigh = offset >> 32;
+
+		DWORD written;
+		const DWORD size = std::min<std::size_t>(data.size(), 1 << 30);
+
+		if (!WriteFile(handle, data.data(), size, &written, &overlapped) || written == 0)
+			throw std::runtime_error("failed to write file " + path.string());
+#else
+		const ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written <= 0)
+			throw std::runtime_error("failed to write file " + path.string());
+#endif
+
+		data = data.subspan(written);
+		offset += written;
+	}
+}
+
+void FileWriter::fill(u64 offset, u64 size, u8 value)
+{
+	const std::vector<u8> chunk(std::min<u64>(size, chunkSize), value);
+
+	while (size)
+	{
+		const std::size_t n = std::min<u64>(size, chunk.size());
+		write(offset, std::span(chunk).first(n));
+
+		offset += n;
+		size -= n;
+	}
+}
+
+#ifndef _WIN32
+/**
+ * @brief Copy as much as possible of a part of another file without reading it into memory.
+ *
+ * @return The number of bytes copied. The rest has to be copied the usual way.
+ */
+u64 FileWriter::transferInKernel(
+	[[maybe_unused]] int sourceFd,
+	[[maybe_unused]] u64 sourceOffset,
+	[[maybe_unused]] u64 offset,
+	[[maybe_unused]] u64 size
+)
+{
+	u64 copied = 0;
+
+#ifdef __linux__
+	// Only whole blocks can be cloned, from and to offsets that are multiples of the block size
+	if (canClone && blockSize && sourceOffset % blockSize == 0 && offset % blockSize == 0 && size >= blockSize)
+	{
+		file_clone_range range = {};
+		range.src_fd = sourceFd;
+		range.src_offset = sourceOffset;
+		range.src_length = size - size % blockSize;
+		range.dest_offset = offset;
+
+		if (ioctl(fd, FICLONERANGE, &range) == 0)
+			copied = range.src_length;
+		else
+			canClone = false;
+	}
+
+	while (canCopyRange && copied < size)
+	{
+		loff_t sourcePos = sourceOffset + copied;
+		loff_t destPos = offset + copied;
+
+		const ssize_t n = copy_file_range(sourceFd, &sourcePos, fd, &destPos, size - copied, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0 && errno != EIO && errno != ENOSPC)
+			canCopyRange = false; // e.g. across file systems on older kernels
+
+		if (n <= 0)
+			break;
+
+		copied += n;
+	}
+
+	if (copied < size)
+	{
+		// sendfile writes at the current position of the output file, which all threads share
+		std::lock_guard lock(positionMutex);
+		off_t sourcePos = sourceOffset + copied;
+
+		while (copied < size && lseek(fd, offset + copied, SEEK_SET) >= 0)
+		{
+			const ssize_t n = sendfile(fd, sourceFd, &sourcePos, size - copied);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n <= 0)
+				break;
+
+			copied += n;
+		}
+	}
+#endif
+
+	return copied;
+}
+#endif
+
+void FileWriter::copy(u64 offset, const fs::path& sourcePath, u64 sourceOffset, u64 size)
+{
+#ifndef _WIN32
+	const int sourceFd = open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (sourceFd < 0)
+		throw std::runtime_error("failed to open file " + sourcePath.string());
+
+	const u64 copied = transferInKernel(sourceFd, sourceOffset, offset, size);
+	close(sourceFd);
+
+	if (copied == size)
+		return;
+
+	offset += copied;
+	size -= copied;
+#else
+	const u64 copied = 0;
+#endif
+
+	std::ifstream source(sourcePath, std::ios::binary | std::ios::in);
+
+	if (!source.is_open() || !source.seekg(sourceOffset + copied))
+		throw std::runtime_error("failed to open file " + sourcePath.string());
+
+	std::vector<u8> chunk(std::min<u64>(size, chunkSize));
+
+	while (size)
+	{
+		const std::size_t n = std::min<u64>(size, chunk.size());
+
+		if (!source.read(reinterpret_cast<char*>(chunk.data()), n))
+			throw std::runtime_error("failed to read file " + sourcePath.string());
+
+		write(offset, std::span(chunk).first(n));
+
+		offset += n;
+		size -= n;
+	}
+}
+
+void FileWriter::commit()
+{
+#ifdef _WIN32
+	const bool closed = CloseHandle(handle);
+	handle = INVALID_HANDLE_VALUE;
+#else
+	const bool closed = close(fd) == 0;
+	fd = -1;
+#endif
+
+	if (tempPath.empty())
+	{
+		if (!closed)
+			throw std::runtime_error("failed to write file " + path.string());
+
+		return;
+	}
+
+	std::error_code ec;
+
+	if (closed)
+		fs::rename(tempPath, path, ec);
+
+	if (!closed || ec)
+	{
+		fs::remove(tempPath, ec);
+		throw std::runtime_error("failed to write file " + path.string());
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <mutex>
+#include <span>
+
+/**
+ * @brief Writes a file at arbitrary offsets without keeping it in memory.
+ *
+ * The data goes to a temporary file next to the output file, which replaces
+ * the output file when commit is called. If the writer is destroyed before
+ * that, the temporary file is removed and the output file stays as it was.
+ *
+ * Alternatively, an existing file can be patched in place. Then there is no
+ * temporary file, and an interrupted write leaves the file partially patched.
+ *
+ * write, fill and copy may be called from several threads at once, as long as
+ * the ranges they write to don't overlap.
+ */
+class FileWriter
+{
+	fs::path path;
+	fs::path tempPath; // empty when patching in place
+
+#ifdef _WIN32
+	void* handle;
+#else
+	int fd;
+	u64 blockSize = 0;                   // of the file system, for cloning
+	std::atomic<bool> canClone = true;   // cleared once the file system turns out not to support it
+	std::atomic<bool> canCopyRange = true;
+	std::mutex positionMutex;            // sendfile writes at the file position
+
+	u64 transferInKernel(int sourceFd, u64 sourceOffset, u64 offset, u64 size);
+#endif
+
+public:
+	enum class Mode
+	{
+		replace, ///< write a new file that replaces the output file on commit
+		patch    ///< write into the existing output file
+	};
+
+	FileWriter(const fs::path& path, Mode mode = Mode::replace);
+	~FileWriter();
+
+	FileWriter(const FileWriter&) = delete;
+	FileWriter& operator=(const FileWriter&) = delete;
+
+	/**
+	 * @brief Set the size of the file, and reserve disk space for it if the file system supports it.
+	 *
+	 * Bytes added to the end of the file are zero.
+	 */
+	void resize(u64 size);
+
+	/**
+	 * @brief Write data at an offset.
+	 */
+	void write(u64 offset, std::span<const u8> data);
+
+	/**
+	 * @brief Write the same byte repeatedly, a chunk at a time.
+	 */
+	void fill(u64 offset, u64 size, u8 value);
+
+	/**
+	 * @brief Copy a part of another file.
+	 *
+	 * On Linux, the data doesn't pass through user space: whole file system blocks are
+	 * shared with the source file (FICLONERANGE) where the file system supports it, and
+	 * the rest is copied with copy_file_range or sendfile. Otherwise, or if these fail,
+	 * the data is read and written a chunk at a time.
+	 *
+	 * @param offset Where to write the data.
+	 * @param sourcePath The file to read from.
+	 * @param sourceOffset Where to start reading.
+	 * @param size The number of bytes to copy.
+	 */
+	void copy(u64 offset, const fs::path& sourcePath, u64 sourceOffset, u64 size);
+
+	/**
+	 * @brief Copy the beginning of another file.
+	 */
+	void copy(u64 offset, const fs::path& sourcePath, u64 size) { copy(offset, sourcePath, 0, size); }
+
+	/**
+	 * @brief Close the file and replace the output file with it, unless it is patched in place.
+	 */
+	void commit();
+};